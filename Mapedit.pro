@@ -6,18 +6,31 @@
 
 QT       += core gui
 
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
 
 TARGET = Mapedit
 TEMPLATE = app
 
 
 SOURCES += main.cpp\
+    mapdocument.cpp \
     mapwidget.cpp \
-    mainwindow.cpp
+    mainwindow.cpp \
+    tilecache.cpp \
+    objectlayer.cpp \
+    tileusage.cpp \
+    autotile.cpp \
+    mapsave.cpp
 
 HEADERS  += \
+    mapdocument.h \
     mapwidget.h \
-    mainwindow.h
+    mainwindow.h \
+    tilecache.h \
+    objectlayer.h \
+    tileusage.h \
+    autotile.h \
+    mapsave.h \
+    runtime/maprt.h
 
 FORMS    +=
@@ -0,0 +1,137 @@
+/*
+ * \file autotile.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of auto-tiling rules.
+ **/
+#include "autotile.h"
+
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+
+/*!
+ * \throw QString with the error description.
+ */
+void AutoTileRules::load(QString const & filename)
+{
+    QFile qf(filename);
+    if (!qf.open(QIODevice::ReadOnly)) throw qf.errorString();
+    QJsonDocument jsn_doc = QJsonDocument::fromJson(qf.readAll());
+    qf.close();
+    if (jsn_doc.isNull()) throw QString("Failed to validate JSON data");
+    if (!jsn_doc.isObject()) throw QString("Top level JSON value is not an object");
+    fromJson(jsn_doc.object());
+}
+
+/*!
+ * \throw QString with the error description.
+ */
+void AutoTileRules::fromJson(QJsonObject const & jsn_rules)
+{
+    if (!jsn_rules.value("sets").isArray()) throw QString("'sets' is not an array");
+    QJsonArray jsn_sets = jsn_rules.value("sets").toArray();
+
+    QVector<RuleSet> sets;
+    for(QJsonArray::const_iterator i = jsn_sets.begin(); i != jsn_sets.end(); ++i) {
+        if (!(*i).isObject()) throw QString("Rule set is not an object");
+        QJsonObject jsn_set = (*i).toObject();
+        if (!jsn_set.value("tiles").isObject()) throw QString("'tiles' of a rule set is not an object");
+        QJsonObject jsn_tiles = jsn_set.value("tiles").toObject();
+
+        RuleSet set;
+        set.name = jsn_set.value("name").toString();
+        for(int m = 0; m < AUTOTILE_VARIANTS; ++m)
+            set.variants << QString();
+        for(QJsonObject::const_iterator t = jsn_tiles.begin(); t != jsn_tiles.end(); ++t) {
+            bool ok = false;
+            int mask = t.key().toInt(&ok);
+            if (!ok || mask < 0 || mask >= AUTOTILE_VARIANTS) throw QString("Incorrect neighbour mask in rule set");
+            if (!t.value().isString()) throw QString("Incorrect tile in rule set");
+            set.variants[mask] = t.value().toString();
+        }
+        sets << set;
+    }
+
+    mSets = sets;
+    mTerrainOf.clear();
+    mVariants.clear();
+}
+
+QJsonObject AutoTileRules::toJson() const
+{
+    QJsonArray jsn_sets;
+    for(int s = 0; s < mSets.size(); ++s) {
+        QJsonObject jsn_tiles;
+        for(int m = 0; m < AUTOTILE_VARIANTS; ++m) {
+            if (!mSets[s].variants[m].isEmpty())
+                jsn_tiles.insert(QString("%1").arg(m), QJsonValue(mSets[s].variants[m]));
+        }
+        QJsonObject jsn_set;
+        jsn_set.insert("name", QJsonValue(mSets[s].name));
+        jsn_set.insert("tiles", jsn_tiles);
+        jsn_sets.push_back(jsn_set);
+    }
+    QJsonObject jsn_rules;
+    jsn_rules.insert("sets", jsn_sets);
+    return jsn_rules;
+}
+
+/*!
+ * \brief Resolve tile names of the rules to ids of a tile list. Must be called whenever tile ids change.
+ */
+void AutoTileRules::compile(QStringList const & tileNames)
+{
+    QHash<QString, int> ids;
+    for(int i = 0; i < tileNames.size(); ++i) {
+        if (!ids.contains(tileNames[i]))
+            ids.insert(tileNames[i], i);
+    }
+
+    mTerrainOf = QVector<int>(tileNames.size(), -1);
+    mVariants = QVector<QVector<int> >(mSets.size(), QVector<int>(AUTOTILE_VARIANTS, -1));
+    for(int s = 0; s < mSets.size(); ++s) {
+        for(int m = 0; m < AUTOTILE_VARIANTS; ++m) {
+            QHash<QString, int>::const_iterator it = ids.find(mSets[s].variants[m]);
+            if (it == ids.end()) continue;
+            mVariants[s][m] = it.value();
+            if (mTerrainOf[it.value()] < 0)
+                mTerrainOf[it.value()] = s;
+        }
+    }
+}
+
+/*!
+ * \brief Tile which a cell should have according to its neighbours.
+ * \return The current tile if the cell is not a terrain or the rules miss the variant.
+ */
+int AutoTileRules::resolve(int const * cells, int cols, int rows, int x, int y) const
+{
+    int tile = cells[x + y * cols];
+    int terrain = terrainOf(tile);
+    if (terrain < 0) return tile;
+
+    int mask = 0;
+    if (y == 0 || terrainOf(cells[x + (y - 1) * cols]) == terrain) mask |= AUTOTILE_NORTH;
+    if (x == cols - 1 || terrainOf(cells[x + 1 + y * cols]) == terrain) mask |= AUTOTILE_EAST;
+    if (y == rows - 1 || terrainOf(cells[x + (y + 1) * cols]) == terrain) mask |= AUTOTILE_SOUTH;
+    if (x == 0 || terrainOf(cells[x - 1 + y * cols]) == terrain) mask |= AUTOTILE_WEST;
+
+    int variant = mVariants[terrain][mask];
+    return variant >= 0 ? variant : tile;
+}
+
+/*!
+ * \brief Ids of all tiles which the compiled rules may place, whether they are on the map or not.
+ */
+QVector<int> AutoTileRules::variantTiles() const
+{
+    QVector<int> tiles;
+    for(int s = 0; s < mVariants.size(); ++s) {
+        for(int m = 0; m < AUTOTILE_VARIANTS; ++m) {
+            if (mVariants[s][m] >= 0)
+                tiles << mVariants[s][m];
+        }
+    }
+    return tiles;
+}
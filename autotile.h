@@ -0,0 +1,60 @@
+/*
+ * \file autotile.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Rule-based auto-tiling: a cell of a terrain gets the variant matching its neighbours.
+ **/
+#ifndef AUTOTILE_H
+#define AUTOTILE_H
+
+#include <QJsonObject>
+#include <QRect>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#define AUTOTILE_NORTH 1
+#define AUTOTILE_EAST  2
+#define AUTOTILE_SOUTH 4
+#define AUTOTILE_WEST  8
+#define AUTOTILE_VARIANTS 16
+
+/*!
+ * \brief Sets of terrain variants selected by a 4-bit mask of neighbours.
+ *
+ * Every set (e.g. "water") lists up to 16 tiles, one per mask of the cardinal
+ * neighbours which belong to the same set: north = 1, east = 2, south = 4, west = 8.
+ * A cell with a tile of a set is replaced by the variant for its mask, cells beyond
+ * the map border count as the same terrain. Tiles are named as in the tile list
+ * ("file.png" or "sheet.png#index"), so rules survive renumbering of tiles.
+ *
+ * Rules file:
+ * \code
+ * { "sets": [ { "name": "water", "tiles": { "0": "water.png#0", ..., "15": "water.png#15" } } ] }
+ * \endcode
+ */
+class AutoTileRules
+{
+public:
+    void load(QString const & filename);
+    void fromJson(QJsonObject const & jsn_rules);
+    QJsonObject toJson() const;
+    void compile(QStringList const & tileNames);
+
+    inline bool isEmpty() const { return mSets.isEmpty(); }
+    inline int terrainOf(int tile) const { return tile >= 0 && tile < mTerrainOf.size() ? mTerrainOf[tile] : -1; }
+    int resolve(int const * cells, int cols, int rows, int x, int y) const;
+    QVector<int> variantTiles() const;
+
+private:
+    struct RuleSet {
+        QString name;
+        QStringList variants; // tile names, one per mask, empty if missing
+    };
+    QVector<RuleSet> mSets;
+
+    // compiled for the current tile list
+    QVector<int> mTerrainOf;          // tile id -> set, -1 if the tile is not a terrain variant
+    QVector<QVector<int> > mVariants; // set -> mask -> tile id
+};
+
+#endif // AUTOTILE_H
@@ -0,0 +1,130 @@
+/*
+ * \file runtimebench.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Compares loading a map from the editor's JSON with opening its runtime export.
+ *
+ * Usage: runtimebench <map.json> <map.mapr> [iterations]
+ *
+ * Both paths end with a map which can answer "tile at (row, col)", then the same
+ * pseudo-random cell lookups are done on each one.
+ **/
+#include "maprt.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStringList>
+#include <QTextStream>
+#include <QVector>
+
+static const int LOOKUPS = 1000000;
+
+struct JsonMap {
+    int rows, cols;
+    QVector<int> cells;
+    QStringList tiles;
+};
+
+static bool loadJson(QString const & filename, JsonMap & map)
+{
+    QFile qf(filename);
+    if (!qf.open(QIODevice::ReadOnly)) return false;
+    QJsonDocument jsn_doc = QJsonDocument::fromJson(qf.readAll());
+    if (!jsn_doc.isObject()) return false;
+    QJsonObject jsn_map = jsn_doc.object();
+    map.rows = int(jsn_map.value("rows").toDouble());
+    map.cols = int(jsn_map.value("cols").toDouble());
+
+    QJsonObject jsn_tiles = jsn_map.value("tiles").toObject();
+    map.tiles.clear();
+    for(QJsonObject::const_iterator i = jsn_tiles.begin(); i != jsn_tiles.end(); ++i)
+        map.tiles << i.value().toString();
+
+    QJsonArray jsn_cells = jsn_map.value("cells").toArray();
+    map.cells.resize(jsn_cells.size());
+    int index = 0;
+    for(QJsonArray::const_iterator i = jsn_cells.begin(); i != jsn_cells.end(); ++i)
+        map.cells[index++] = int((*i).toDouble());
+    return map.cells.size() == map.rows * map.cols;
+}
+
+// xorshift, so both loops visit the same cells
+static inline quint32 nextRandom(quint32 & state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    QStringList args = app.arguments();
+    if (args.size() < 3) {
+        out << "Usage: runtimebench <map.json> <map.mapr> [iterations]\n";
+        return 2;
+    }
+    int iterations = args.size() > 3 ? qMax(1, args[3].toInt()) : 10;
+    QByteArray runtimeFile = QFile::encodeName(args[2]);
+
+    QElapsedTimer timer;
+    qint64 jsonLoad = 0, jsonLookup = 0, rtLoad = 0, rtLookup = 0;
+    qint64 jsonSum = 0, rtSum = 0;
+
+    for(int it = 0; it < iterations; ++it) {
+        JsonMap jmap;
+        timer.start();
+        if (!loadJson(args[1], jmap)) {
+            out << "Failed to load " << args[1] << "\n";
+            return 1;
+        }
+        jsonLoad += timer.nsecsElapsed();
+        if (jmap.rows <= 0 || jmap.cols <= 0) {
+            out << "Map " << args[1] << " has no cells\n";
+            return 1;
+        }
+
+        timer.start();
+        quint32 state = 2463534242u;
+        for(int i = 0; i < LOOKUPS; ++i) {
+            quint32 r = nextRandom(state);
+            jsonSum += jmap.cells[int((r >> 16) % jmap.rows) * jmap.cols + int((r & 0xffff) % jmap.cols)];
+        }
+        jsonLookup += timer.nsecsElapsed();
+
+        maprt::Map rmap;
+        timer.start();
+        if (!rmap.open(runtimeFile.constData())) {
+            out << "Failed to open " << args[2] << "\n";
+            return 1;
+        }
+        rtLoad += timer.nsecsElapsed();
+        if (rmap.rows() <= 0 || rmap.cols() <= 0) {
+            out << "Map " << args[2] << " has no cells\n";
+            return 1;
+        }
+
+        timer.start();
+        state = 2463534242u;
+        for(int i = 0; i < LOOKUPS; ++i) {
+            quint32 r = nextRandom(state);
+            rtSum += rmap.cell((r >> 16) % rmap.rows(), (r & 0xffff) % rmap.cols());
+        }
+        rtLookup += timer.nsecsElapsed();
+    }
+
+    if (jsonSum != rtSum)
+        out << "WARNING: maps differ (checksums " << jsonSum << " vs " << rtSum << ")\n";
+
+    out << "iterations: " << iterations << ", lookups per iteration: " << LOOKUPS << "\n";
+    out << "JSON    load " << double(jsonLoad) / iterations / 1e6 << " ms, lookups " << double(jsonLookup) / iterations / 1e6 << " ms\n";
+    out << "runtime load " << double(rtLoad) / iterations / 1e6 << " ms, lookups " << double(rtLookup) / iterations / 1e6 << " ms\n";
+    if (rtLoad > 0)
+        out << "load speedup: " << double(jsonLoad) / double(rtLoad) << "x\n";
+    return 0;
+}
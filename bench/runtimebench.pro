@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Load time benchmark: editor JSON vs runtime map
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = runtimebench
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += ../runtime
+
+SOURCES += runtimebench.cpp
+
+HEADERS  += ../runtime/maprt.h
@@ -14,16 +14,21 @@
 #include <QPushButton>
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QDialog>
+#include <QDialogButtonBox>
+#include <QTimer>
+#include <QtConcurrent>
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent)
 {   
-    /* Map widget */
+    /* Map document and its views */
 
-    map = new MapWidget;
-    connect(map, SIGNAL(cellSelected()), this, SLOT(onCellSelected()));
-    connect(map, SIGNAL(cellDeselected()), this, SLOT(onCellDeselected()));
-    connect(map, SIGNAL(miscellaneousNotification(QString const&)), this, SLOT(onMiscNotify(QString const&)));
+    doc = new MapDocument(this);
+    connect(doc, SIGNAL(tilesChanged()), this, SLOT(refreshTileList()));
+    connect(doc, SIGNAL(mapLoaded()), this, SLOT(refreshTileList()));
+    map = current = createView();
+    splitMap = NULL;
 
     /* Properites bar */
 
@@ -42,6 +47,10 @@ MainWindow::MainWindow(QWidget *parent) :
         selectTileset->setText("Add tiles...");
         connect(selectTileset, SIGNAL(clicked()), this, SLOT(onSelectTileset()));
         propsLayout->addRow(createLabel("Tile set:"), selectTileset);
+        selectSpriteSheet = new QPushButton;
+        selectSpriteSheet->setText("Add sprite sheet...");
+        connect(selectSpriteSheet, SIGNAL(clicked()), this, SLOT(onSelectSpriteSheet()));
+        propsLayout->addRow(createLabel(""), selectSpriteSheet);
         scaleCombo = new QComboBox;
         scaleCombo->addItem("200%");
         scaleCombo->addItem("150%");
@@ -56,16 +65,30 @@ MainWindow::MainWindow(QWidget *parent) :
         connect(scaleCombo, SIGNAL(currentIndexChanged(QString)), this, SLOT(onScaleSet(QString)));
         connect(scaleCombo, SIGNAL(editTextChanged(QString)), this, SLOT(onScaleSet(QString)));
         propsLayout->addRow(createLabel("Scale: "), scaleCombo);
+        tileMemory = new QSpinBox;
+        tileMemory->setRange(16, 65536);
+        tileMemory->setSuffix(" MB");
+        tileMemory->setValue(doc->getTileCache().budget());
+        connect(tileMemory, SIGNAL(valueChanged(int)), this, SLOT(onTileMemoryChanged(int)));
+        propsLayout->addRow(createLabel("Tile memory:"), tileMemory);
 
         propsLayout->addRow(createLabel("Cell properties"));
         tiles = new QComboBox;
         connect(tiles, SIGNAL(currentIndexChanged(int)), this, SLOT(onTileChanged(int)));
         propsLayout->addRow(createLabel("Type:"), tiles);
+        brushSize = new QSpinBox;
+        brushSize->setRange(1, 64);
+        brushSize->setValue(1);
+        connect(brushSize, SIGNAL(valueChanged(int)), this, SLOT(onBrushSizeChanged(int)));
+        propsLayout->addRow(createLabel("Brush size:"), brushSize);
     props->setLayout(propsLayout);
 
+    views = new QSplitter(Qt::Vertical);
+    views->addWidget(map);
+
     QSplitter * splitter = new QSplitter;
     splitter->addWidget(props);
-    splitter->addWidget(map);
+    splitter->addWidget(views);
     setCentralWidget(splitter);
     setWindowTitle("MapEd");
 
@@ -74,8 +97,16 @@ MainWindow::MainWindow(QWidget *parent) :
     status = new QStatusBar;
     status->addPermanentWidget(lblSelected = new QLabel);
     lblSelected->setText("None selected");
+    status->addPermanentWidget(lblFrames = new QLabel);
+    status->addPermanentWidget(lblTileCache = new QLabel);
     setStatusBar(status);
 
+    QTimer * statsTimer = new QTimer(this);
+    connect(statsTimer, SIGNAL(timeout()), this, SLOT(onUpdateStats()));
+    statsTimer->start(1000);
+
+    connect(&saveWatcher, SIGNAL(finished()), this, SLOT(onSaveFinished()));
+
     /* Main menu */
 
     QAction * act;
@@ -89,29 +120,59 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(act, SIGNAL(triggered()), this, SLOT(onOpenRequest()));
     act = menu->addAction("&Save...");
     connect(act, SIGNAL(triggered()), this, SLOT(onSaveRequest()));
+    act = menu->addAction("Export for &runtime...");
+    connect(act, SIGNAL(triggered()), this, SLOT(onExportRuntimeRequest()));
     menu->addSeparator();
     act = menu->addAction("&Quit");
     connect(act, SIGNAL(triggered()), qApp, SLOT(quit()));
 
+    menu = menuBar()->addMenu("&Edit");
+    act = doc->undoStack()->createUndoAction(this);
+    act->setShortcut(QKeySequence::Undo);
+    menu->addAction(act);
+    act = doc->undoStack()->createRedoAction(this);
+    act->setShortcut(QKeySequence::Redo);
+    menu->addAction(act);
+    menu->addSeparator();
+    act = menu->addAction("&Merge duplicate tiles");
+    connect(act, SIGNAL(triggered()), this, SLOT(onMergeDuplicateTiles()));
+    act = menu->addAction("&Replace tile...");
+    connect(act, SIGNAL(triggered()), this, SLOT(onReplaceTile()));
+    act = menu->addAction("&Purge unused tiles");
+    connect(act, SIGNAL(triggered()), this, SLOT(onPurgeUnusedTiles()));
+    act = menu->addAction("&Animate tile...");
+    connect(act, SIGNAL(triggered()), this, SLOT(onAnimateTile()));
+    menu->addSeparator();
+    act = menu->addAction("&Load auto-tile rules...");
+    connect(act, SIGNAL(triggered()), this, SLOT(onLoadAutoTileRules()));
+    act = menu->addAction("Auto-&tiling");
+    act->setCheckable(true);
+    connect(act, SIGNAL(toggled(bool)), this, SLOT(onAutoTiling(bool)));
+    act = menu->addAction("Auto-tile &whole map");
+    connect(act, SIGNAL(triggered()), this, SLOT(onAutoTileMap()));
+
+    menu = menuBar()->addMenu("&View");
+    act = menu->addAction("&Split view");
+    act->setCheckable(true);
+    connect(act, SIGNAL(toggled(bool)), this, SLOT(onSplitView(bool)));
+    animationPreview = menu->addAction("&Play animations");
+    animationPreview->setCheckable(true);
+    connect(animationPreview, SIGNAL(toggled(bool)), this, SLOT(onAnimationPreview(bool)));
+
     menu = menuBar()->addMenu("&Help");
     act = menu->addAction("&About...");
 }
 
 void MainWindow::onOpenRequest()
 {
-    QString fname = QFileDialog::getOpenFileName(this, "Select file", "", "JSON plain-text (*.json);; Binary JSON (*.bson)");
+    QString fname = QFileDialog::getOpenFileName(this, "Select file", "", "JSON plain-text (*.json);; Binary JSON (*.bson);; Compressed JSON (*.mapz)");
     try {
-        map->loadMap(fname);
-        disconnect(tiles, SIGNAL(currentIndexChanged(int)), this, 0);
+        doc->loadMap(fname);
         disconnect(mapRows, SIGNAL(valueChanged(int)), this, 0);
         disconnect(mapCols, SIGNAL(valueChanged(int)), this, 0);
-        tiles->clear();
-        map->insertInto(tiles);
-        tiles->setCurrentIndex(-1);
-        mapRows->setValue(map->getRows());
-        mapCols->setValue(map->getCols());
+        mapRows->setValue(doc->getRows());
+        mapCols->setValue(doc->getCols());
         scaleCombo->setCurrentIndex(2);
-        connect(tiles, SIGNAL(currentIndexChanged(int)), this, SLOT(onTileChanged(int)));
         connect(mapRows, SIGNAL(valueChanged(int)), this, SLOT(onMapSizeChanged(int)));
         connect(mapCols, SIGNAL(valueChanged(int)), this, SLOT(onMapSizeChanged(int)));
     } catch (QString & s) {
@@ -120,11 +181,41 @@ void MainWindow::onOpenRequest()
     }
 }
 
+/*!
+ * \brief Write a snapshot of the map on the thread pool, the map stays editable meanwhile.
+ */
 void MainWindow::onSaveRequest()
 {
-    QString fname = QFileDialog::getSaveFileName(this, "Select file", "", "JSON plain-text (*.json);; Binary JSON (*.bson)");
-    if (!map->saveMap(fname)) {
-        QMessageBox msg(QMessageBox::Critical, "Failed to save map", "TODO HERE");
+    if (saveWatcher.isRunning()) {
+        onMiscNotify("Still saving " + saveFile);
+        return;
+    }
+    QString fname = QFileDialog::getSaveFileName(this, "Select file", "", "JSON plain-text (*.json);; Binary JSON (*.bson);; Compressed JSON (*.mapz)");
+    if (fname.isEmpty()) return;
+
+    saveFile = fname;
+    saveWatcher.setFuture(QtConcurrent::run(writeMapSnapshot, doc->snapshot(fname), fname));
+    status->showMessage("Saving " + fname + "...");
+}
+
+void MainWindow::onSaveFinished()
+{
+    QString error = saveWatcher.result();
+    if (!error.isEmpty()) {
+        status->clearMessage();
+        QMessageBox msg(QMessageBox::Critical, "Failed to save map", error);
+        msg.exec();
+        return;
+    }
+    onMiscNotify("Saved " + saveFile);
+}
+
+void MainWindow::onExportRuntimeRequest()
+{
+    QString fname = QFileDialog::getSaveFileName(this, "Select file", "", "MapEd runtime map (*.mapr)");
+    if (fname.isEmpty()) return;
+    if (!doc->exportRuntime(fname)) {
+        QMessageBox msg(QMessageBox::Critical, "Failed to export map", "Cannot write " + fname);
         msg.exec();
     }
 }
@@ -134,13 +225,144 @@ void MainWindow::onMiscNotify(QString const & msg) {
 }
 
 void MainWindow::onTileChanged(int indx) {
-    map->setSelectedTile(indx);
+    map->setBrushTile(indx);
+    if (splitMap) splitMap->setBrushTile(indx);
+    current->setSelectedTile(indx);
+    if (indx >= 0) {
+        TileUsage const & usage = doc->getTileUsage();
+        onMiscNotify(QString("Tile %1 is used by %2 cells and %3 objects").arg(indx).arg(usage.cells(indx)).arg(usage.objects(indx)));
+    }
+}
+
+void MainWindow::onBrushSizeChanged(int size) {
+    map->setBrushSize(size);
+    if (splitMap) splitMap->setBrushSize(size);
+}
+
+void MainWindow::onMergeDuplicateTiles() {
+    int removed = doc->mergeDuplicateTiles();
+    onMiscNotify(QString("Merged %1 duplicate tiles").arg(removed));
+}
+
+void MainWindow::onPurgeUnusedTiles() {
+    int removed = doc->purgeUnusedTiles();
+    onMiscNotify(QString("Removed %1 unused tiles").arg(removed));
+}
+
+void MainWindow::onReplaceTile() {
+    if (!doc->getTilesCount()) return;
+
+    QDialog dlg(this);
+    dlg.setWindowTitle("Replace tile");
+    QFormLayout * layout = new QFormLayout;
+    QComboBox * from = new QComboBox;
+    QComboBox * to = new QComboBox;
+    copyTileList(from);
+    copyTileList(to);
+    from->setCurrentIndex(tiles->currentIndex());
+    layout->addRow(createLabel("Replace:"), from);
+    layout->addRow(createLabel("With:"), to);
+    QDialogButtonBox * buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(buttons, SIGNAL(accepted()), &dlg, SLOT(accept()));
+    connect(buttons, SIGNAL(rejected()), &dlg, SLOT(reject()));
+    layout->addRow(buttons);
+    dlg.setLayout(layout);
+    if (dlg.exec() != QDialog::Accepted) return;
+
+    int changed = doc->replaceTile(from->currentIndex(), to->currentIndex());
+    onMiscNotify(QString("Replaced %1 cells").arg(changed));
+}
+
+void MainWindow::onAnimationPreview(bool on) {
+    map->setAnimationPreview(on);
+    if (splitMap) splitMap->setAnimationPreview(on);
+}
+
+/*!
+ * \brief Animate a tile with the tiles which follow it in the tile list, e.g. frames of a sprite sheet row.
+ */
+void MainWindow::onAnimateTile() {
+    if (!doc->getTilesCount()) return;
+
+    QDialog dlg(this);
+    dlg.setWindowTitle("Animate tile");
+    QFormLayout * layout = new QFormLayout;
+    QComboBox * tile = new QComboBox;
+    QSpinBox * frames = new QSpinBox;
+    QSpinBox * duration = new QSpinBox;
+    copyTileList(tile);
+    tile->setCurrentIndex(qMax(0, tiles->currentIndex()));
+    frames->setRange(1, 256);
+    frames->setValue(4);
+    duration->setRange(1, 60000);
+    duration->setSuffix(" ms");
+    duration->setValue(150);
+    layout->addRow(createLabel("Tile:"), tile);
+    layout->addRow(createLabel("Frames:"), frames);
+    layout->addRow(createLabel("Frame duration:"), duration);
+    layout->addRow(createLabel("One frame stops the animation"));
+    QDialogButtonBox * buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(buttons, SIGNAL(accepted()), &dlg, SLOT(accept()));
+    connect(buttons, SIGNAL(rejected()), &dlg, SLOT(reject()));
+    layout->addRow(buttons);
+    dlg.setLayout(layout);
+    if (dlg.exec() != QDialog::Accepted) return;
+
+    int first = tile->currentIndex();
+    int count = qMin(frames->value(), doc->getTilesCount() - first);
+    QVector<int> ids, durations;
+    for(int i = 0; count > 1 && i < count; ++i) {
+        ids << first + i;
+        durations << duration->value();
+    }
+    doc->setTileAnimation(first, ids, durations);
+}
+
+void MainWindow::onLoadAutoTileRules() {
+    QString fname = QFileDialog::getOpenFileName(this, "Select auto-tile rules", "", "JSON plain-text (*.json)");
+    if (fname.isEmpty()) return;
+    try {
+        doc->loadAutoTileRules(fname);
+    } catch (QString & s) {
+        QMessageBox msg(QMessageBox::Critical, "Failed to load auto-tile rules", s);
+        msg.exec();
+    }
+}
+
+void MainWindow::onAutoTiling(bool on) {
+    doc->setAutoTiling(on);
+    if (on && !doc->hasAutoTileRules())
+        onMiscNotify("No auto-tile rules loaded");
+}
+
+void MainWindow::onAutoTileMap() {
+    int changed = doc->autoTileMap();
+    onMiscNotify(QString("Auto-tiled %1 cells").arg(changed));
+}
+
+void MainWindow::onUpdateStats() {
+    MapWidget::FrameStats const & st = current->getFrameStats();
+    lblFrames->setText(QString("Frames: %1, late: %2, dropped: %3, coalesced: %4").arg(st.frames).arg(st.late).arg(st.dropped).arg(st.coalesced));
+
+    TileCache const & cache = doc->getTileCache();
+    lblTileCache->setText(QString("Tiles: %1 MB of %2 MB (%3 MB packed), hits: %4, misses: %5")
+        .arg(cache.residentBytes() / (1024 * 1024))
+        .arg(cache.budget())
+        .arg(cache.packedBytes() / (1024 * 1024))
+        .arg(cache.stats().hits)
+        .arg(cache.stats().misses));
+}
+
+void MainWindow::onTileMemoryChanged(int megabytes) {
+    doc->setTileMemoryBudget(megabytes);
 }
 
 void MainWindow::onCellSelected() {
+    MapWidget * view = qobject_cast<MapWidget *>(sender());
+    if (view) current = view;
     disconnect(tiles, SIGNAL(currentIndexChanged(int)), this, 0);
-    tiles->setCurrentIndex(map->getSelectedTile());
-    QRect sel = map->getSelectedTilesCount();
+    tiles->setCurrentIndex(current->getSelectedTile());
+    QRect sel = current->getSelectedTilesCount();
     QString s = QString("Selected %1 cells (%2X%3)").arg(sel.width() * sel.height()).arg(sel.width()).arg(sel.height());
     lblSelected->setText(s);
     connect(tiles, SIGNAL(currentIndexChanged(int)), this, SLOT(onTileChanged(int)));
@@ -155,21 +377,89 @@ void MainWindow::onCellDeselected() {
 
 void MainWindow::onScaleSet(QString s) {
     int scale = s.split('%')[0].toInt();
-    map->setScale(((float)scale) / 100.0f);
+    current->setScale(((float)scale) / 100.0f);
 }
 
 void MainWindow::onMapSizeChanged(int) {
-    map->setMapSize(mapRows->value(), mapCols->value());
+    doc->setMapSize(mapRows->value(), mapCols->value());
 }
 
-void MainWindow::loadTileSet(QStringList const & files) {
-    if (map->addTiles(files)) {
-        map->insertInto(tiles);
-        tiles->setCurrentIndex(-1);
-        map->update();
+/*!
+ * \brief Show or hide the second view of the document, e.g. for a detail at another zoom.
+ */
+void MainWindow::onSplitView(bool on) {
+    if (on && !splitMap) {
+        splitMap = createView();
+        splitMap->setBrushSize(brushSize->value());
+        splitMap->setBrushTile(tiles->currentIndex());
+        splitMap->setAnimationPreview(animationPreview->isChecked());
+        views->addWidget(splitMap);
+    } else if (!on && splitMap) {
+        if (current == splitMap) current = map;
+        delete splitMap;
+        splitMap = NULL;
     }
 }
 
+MapWidget * MainWindow::createView() {
+    MapWidget * view = new MapWidget(doc);
+    connect(view, SIGNAL(cellSelected()), this, SLOT(onCellSelected()));
+    connect(view, SIGNAL(cellDeselected()), this, SLOT(onCellDeselected()));
+    connect(view, SIGNAL(miscellaneousNotification(QString const&)), this, SLOT(onMiscNotify(QString const&)));
+    return view;
+}
+
+void MainWindow::refreshTileList() {
+    disconnect(tiles, SIGNAL(currentIndexChanged(int)), this, 0);
+    tiles->clear();
+    doc->insertInto(tiles);
+    tiles->setCurrentIndex(-1);
+    connect(tiles, SIGNAL(currentIndexChanged(int)), this, SLOT(onTileChanged(int)));
+}
+
+/*!
+ * \brief Fill a combo box with the items of the tile list, sharing their icons instead of making new ones.
+ */
+void MainWindow::copyTileList(QComboBox * list) {
+    for(int i = 0; i < tiles->count(); ++i)
+        list->addItem(tiles->itemIcon(i), tiles->itemText(i));
+}
+
+void MainWindow::loadTileSet(QStringList const & files) {
+    doc->addTiles(files);
+}
+
+void MainWindow::onSelectSpriteSheet() {
+    QString file = QFileDialog::getOpenFileName(this, "Select sprite sheet", "", "Images (*.png *.xpm *.jpg *.bmp *.jpeg)");
+    if (file.isEmpty()) return;
+
+    QDialog dlg(this);
+    dlg.setWindowTitle("Slice sprite sheet");
+    QFormLayout * layout = new QFormLayout;
+    QSpinBox * tileWidth = new QSpinBox;
+    QSpinBox * tileHeight = new QSpinBox;
+    QSpinBox * margin = new QSpinBox;
+    QSpinBox * spacing = new QSpinBox;
+    tileWidth->setRange(1, 4096);
+    tileHeight->setRange(1, 4096);
+    margin->setRange(0, 4096);
+    spacing->setRange(0, 4096);
+    tileWidth->setValue(32);
+    tileHeight->setValue(32);
+    layout->addRow(createLabel("Tile width:"), tileWidth);
+    layout->addRow(createLabel("Tile height:"), tileHeight);
+    layout->addRow(createLabel("Margin:"), margin);
+    layout->addRow(createLabel("Spacing:"), spacing);
+    QDialogButtonBox * buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(buttons, SIGNAL(accepted()), &dlg, SLOT(accept()));
+    connect(buttons, SIGNAL(rejected()), &dlg, SLOT(reject()));
+    layout->addRow(buttons);
+    dlg.setLayout(layout);
+    if (dlg.exec() != QDialog::Accepted) return;
+
+    doc->addTileSheet(file, QSize(tileWidth->value(), tileHeight->value()), margin->value(), spacing->value());
+}
+
 void MainWindow::onSelectTileset() {
     QStringList files = QFileDialog::getOpenFileNames(this, "Select one or more files to open", "", "Images (*.png *.xpm *.jpg *.bmp *.jpeg)");
     loadTileSet(files);
@@ -184,4 +474,5 @@ QLabel *MainWindow::createLabel(const QString &text)
 
 MainWindow::~MainWindow()
 {
+    saveWatcher.waitForFinished();
 }
@@ -15,6 +15,9 @@
 #include <QPushButton>
 #include <QVBoxLayout>
 #include <QStatusBar>
+#include <QSplitter>
+#include <QFutureWatcher>
+#include "mapdocument.h"
 #include "mapwidget.h"
 
 namespace Ui {
@@ -33,28 +36,58 @@ protected:
 //    bool event(QEvent *event);
 
 private:
+    MapDocument *doc;
     MapWidget *map;
+    MapWidget *splitMap;
+    MapWidget *current; // the view which was selected in last
+    QSplitter *views;
+    QAction *animationPreview;
     QGroupBox *props;
     QComboBox *tiles;
     QSpinBox *mapRows;
     QSpinBox *mapCols;
+    QSpinBox *brushSize;
+    QSpinBox *tileMemory;
     QPushButton *selectTileset;
+    QPushButton *selectSpriteSheet;
     QComboBox *scaleCombo;
     QStatusBar *status;
     QLabel *lblSelected;
+    QLabel *lblFrames;
+    QLabel *lblTileCache;
+    QFutureWatcher<QString> saveWatcher; // map being written in background
+    QString saveFile;
     QLabel *createLabel(const QString &text);
     void loadTileSet(QStringList const & files);
+    MapWidget *createView();
+    void copyTileList(QComboBox * list);
 
 protected slots:
     void onMiscNotify(QString const &);
     void onOpenRequest();
     void onSaveRequest();
+    void onSaveFinished();
+    void onExportRuntimeRequest();
     void onSelectTileset();
+    void onSelectSpriteSheet();
     void onMapSizeChanged(int);
     void onScaleSet(QString);
     void onCellSelected();
     void onCellDeselected();
     void onTileChanged(int);
+    void onBrushSizeChanged(int);
+    void onUpdateStats();
+    void onTileMemoryChanged(int);
+    void onMergeDuplicateTiles();
+    void onPurgeUnusedTiles();
+    void onReplaceTile();
+    void onAnimateTile();
+    void onAnimationPreview(bool);
+    void onLoadAutoTileRules();
+    void onAutoTiling(bool);
+    void onAutoTileMap();
+    void onSplitView(bool);
+    void refreshTileList();
 };
 
 #endif // MAPEDITOR_H
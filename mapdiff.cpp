@@ -0,0 +1,300 @@
+/*
+ * \file mapdiff.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of map diff and merge.
+ **/
+#include "mapdiff.h"
+
+#include <QtConcurrent>
+
+QVector<int> TileTable::add(MapFile const & map)
+{
+    QVector<int> remap(map.tiles.size());
+    for(int i = 0; i < map.tiles.size(); ++i) {
+        QString key = map.tileKey(i);
+        QHash<QString, int>::const_iterator it = mIndex.find(key);
+        if (it != mIndex.end()) {
+            remap[i] = it.value();
+            continue;
+        }
+
+        QJsonValue tile = map.tiles[i];
+        if (tile.isObject()) {
+            // sheet references are rewritten to the sheets of the table
+            QJsonObject ref = tile.toObject();
+            int sheet = int(ref.value("sheet").toDouble(-1));
+            if (sheet >= 0 && sheet < map.sheets.size()) {
+                QString skey = map.sheetKey(sheet);
+                QHash<QString, int>::const_iterator s = mSheetIndex.find(skey);
+                int new_sheet;
+                if (s == mSheetIndex.end()) {
+                    new_sheet = mSheets.size();
+                    mSheets.push_back(map.sheets.at(sheet));
+                    mSheetIndex.insert(skey, new_sheet);
+                } else {
+                    new_sheet = s.value();
+                }
+                ref.insert("sheet", QJsonValue(new_sheet));
+                tile = ref;
+            }
+        }
+
+        remap[i] = mTiles.size();
+        mIndex.insert(key, mTiles.size());
+        mKeys << key;
+        mTiles << tile;
+    }
+    return remap;
+}
+
+void TileTable::exportTo(MapFile & map) const
+{
+    map.tiles = mTiles;
+    map.sheets = mSheets;
+}
+
+namespace {
+
+struct ChunkJob {
+    int const * cells;
+    int const * remap;
+    int stride;
+    QRect area;
+    quint64 hash;
+};
+
+// FNV-1a over tile ids translated to the common table
+void hashChunk(ChunkJob & job)
+{
+    quint64 h = Q_UINT64_C(14695981039346656037);
+    for(int j = job.area.top(); j <= job.area.bottom(); ++j) {
+        int const * row = job.cells + j * job.stride;
+        for(int i = job.area.left(); i <= job.area.right(); ++i) {
+            int v = row[i];
+            if (v >= 0) v = job.remap[v];
+            h = (h ^ quint32(v)) * Q_UINT64_C(1099511628211);
+        }
+    }
+    job.hash = h;
+}
+
+inline int chunksAlong(int cells, int chunkSize)
+{
+    return (cells + chunkSize - 1) / chunkSize;
+}
+
+inline QRect chunkArea(int chunk, QSize const & area, int chunkSize)
+{
+    int cols = chunksAlong(area.width(), chunkSize);
+    QRect r((chunk % cols) * chunkSize, (chunk / cols) * chunkSize, chunkSize, chunkSize);
+    return r & QRect(QPoint(0, 0), area);
+}
+
+QVector<int> remapped(MapFile const & map, QVector<int> const & remap)
+{
+    QVector<int> cells(map.cells.size());
+    for(int i = 0; i < cells.size(); ++i) {
+        int v = map.cells[i];
+        cells[i] = v >= 0 ? remap[v] : -1;
+    }
+    return cells;
+}
+
+bool sameCells(MapFile const & a, QVector<int> const & ra, MapFile const & b, QVector<int> const & rb)
+{
+    if (a.rows != b.rows || a.cols != b.cols) return false;
+    QSize area(a.cols, a.rows);
+    return hashChunks(a.cells, a.cols, area, ra) == hashChunks(b.cells, b.cols, area, rb);
+}
+
+} // namespace
+
+/*!
+ * \brief Hash square chunks of cells in parallel.
+ * \param cells Row-major cells.
+ * \param stride Number of columns of the map.
+ * \param area Hashed area starting at (0, 0), may be smaller than the map.
+ * \param remap Translation of tile ids, so that maps with different tile tables are comparable.
+ * \return Hashes of chunks, row-major.
+ */
+QVector<quint64> hashChunks(QVector<int> const & cells, int stride, QSize const & area, QVector<int> const & remap, int chunkSize)
+{
+    int count = area.isEmpty() ? 0 : chunksAlong(area.width(), chunkSize) * chunksAlong(area.height(), chunkSize);
+    QVector<ChunkJob> jobs(count);
+    for(int c = 0; c < count; ++c) {
+        jobs[c].cells = cells.constData();
+        jobs[c].remap = remap.constData();
+        jobs[c].stride = stride;
+        jobs[c].area = chunkArea(c, area, chunkSize);
+        jobs[c].hash = 0;
+    }
+    QtConcurrent::blockingMap(jobs, hashChunk);
+
+    QVector<quint64> hashes(count);
+    for(int c = 0; c < count; ++c)
+        hashes[c] = jobs[c].hash;
+    return hashes;
+}
+
+MapDiff diffMaps(MapFile const & a, MapFile const & b)
+{
+    MapDiff d;
+    d.remapA = d.table.add(a);
+    d.remapB = d.table.add(b);
+    d.sizeA = QSize(a.cols, a.rows);
+    d.sizeB = QSize(b.cols, b.rows);
+
+    QSize common = d.sizeA.boundedTo(d.sizeB);
+    QVector<quint64> ha = hashChunks(a.cells, a.cols, common, d.remapA);
+    QVector<quint64> hb = hashChunks(b.cells, b.cols, common, d.remapB);
+    d.chunks = ha.size();
+    d.changedChunks = 0;
+
+    for(int c = 0; c < ha.size(); ++c) {
+        if (ha[c] == hb[c]) continue;
+        ++d.changedChunks;
+
+        QRect area = chunkArea(c, common, MAPDIFF_CHUNK_SIZE);
+        QRect changed;
+        for(int j = area.top(); j <= area.bottom(); ++j) {
+            for(int i = area.left(); i <= area.right(); ++i) {
+                int va = a.cells[i + j * a.cols];
+                int vb = b.cells[i + j * b.cols];
+                if (va >= 0) va = d.remapA[va];
+                if (vb >= 0) vb = d.remapB[vb];
+                if (va == vb) continue;
+                CellChange ch;
+                ch.x = i;
+                ch.y = j;
+                ch.before = va;
+                ch.after = vb;
+                d.cells << ch;
+                changed |= QRect(i, j, 1, 1);
+            }
+        }
+        if (!changed.isEmpty())
+            d.regions << changed;
+    }
+    return d;
+}
+
+/*!
+ * \brief Three-way merge of map data other than cells and tiles (objects, animations, auto-tiling rules).
+ *
+ * Every key is merged as a whole: a value changed only by theirs is taken, a value changed
+ * differently on both sides is a conflict and keeps ours. Tile ids are compared in the common table.
+ */
+QVector<MergeConflict> mergeExtra(MapFile const & base, QVector<int> const & rB, MapFile const & ours, QVector<int> const & rO,
+                                  MapFile const & theirs, QVector<int> const & rT, MapFile & result)
+{
+    MapFile b = base, o = ours, t = theirs;
+    b.remapExtra(rB);
+    o.remapExtra(rO);
+    t.remapExtra(rT);
+
+    QStringList keys = b.extra.keys() + o.extra.keys() + t.extra.keys();
+    keys.removeDuplicates();
+
+    QVector<MergeConflict> conflicts;
+    result.extra = o.extra;
+    for(QStringList::const_iterator it = keys.begin(); it != keys.end(); ++it) {
+        QJsonValue vb = b.extra.value(*it);
+        QJsonValue vo = o.extra.value(*it);
+        QJsonValue vt = t.extra.value(*it);
+        if (vt == vb || vt == vo) continue;
+        if (vo == vb) {
+            if (vt.isUndefined())
+                result.extra.remove(*it);
+            else
+                result.extra.insert(*it, vt);
+        } else {
+            MergeConflict c;
+            c.key = *it;
+            conflicts << c;
+        }
+    }
+    return conflicts;
+}
+
+/*!
+ * \brief Three-way merge of maps.
+ *
+ * A chunk changed only on one side is taken from that side as a whole; chunks changed
+ * on both sides are merged cell by cell. Conflicting cells keep the value of ours.
+ * Other map data is merged by mergeExtra().
+ *
+ * \param result Merged map, it is based on ours, with a tile table extended by tiles of theirs.
+ * Tile ids of objects and animations are translated to the new table.
+ * \return Conflicting regions, empty if the merge is clean.
+ */
+QVector<MergeConflict> mergeMaps(MapFile const & base, MapFile const & ours, MapFile const & theirs, MapFile & result)
+{
+    QVector<MergeConflict> conflicts;
+
+    TileTable table;
+    QVector<int> rO = table.add(ours);
+    QVector<int> rB = table.add(base);
+    QVector<int> rT = table.add(theirs);
+
+    result = ours;
+    table.exportTo(result);
+    result.cells = remapped(ours, rO);
+    conflicts = mergeExtra(base, rB, ours, rO, theirs, rT, result);
+
+    bool sameSize = ours.rows == base.rows && ours.cols == base.cols
+        && theirs.rows == base.rows && theirs.cols == base.cols;
+
+    if (!sameSize) {
+        // a resize can be merged only if the other side has no changes at all
+        if (sameCells(ours, rO, base, rB) || sameCells(ours, rO, theirs, rT)) {
+            result.rows = theirs.rows;
+            result.cols = theirs.cols;
+            result.cells = remapped(theirs, rT);
+        } else if (!sameCells(theirs, rT, base, rB)) {
+            MergeConflict c;
+            c.region = QRect(0, 0, qMax(ours.cols, theirs.cols), qMax(ours.rows, theirs.rows));
+            c.cells = c.region.width() * c.region.height();
+            conflicts << c;
+        }
+        return conflicts;
+    }
+
+    QSize area(base.cols, base.rows);
+    QVector<quint64> hB = hashChunks(base.cells, base.cols, area, rB);
+    QVector<quint64> hO = hashChunks(ours.cells, ours.cols, area, rO);
+    QVector<quint64> hT = hashChunks(theirs.cells, theirs.cols, area, rT);
+
+    int * out = result.cells.data();
+    for(int c = 0; c < hB.size(); ++c) {
+        if (hO[c] == hT[c] || hT[c] == hB[c]) continue; // nothing to take from theirs
+
+        QRect chunk = chunkArea(c, area, MAPDIFF_CHUNK_SIZE);
+        bool take_all = hO[c] == hB[c];
+        MergeConflict conflict;
+        conflict.cells = 0;
+        for(int j = chunk.top(); j <= chunk.bottom(); ++j) {
+            for(int i = chunk.left(); i <= chunk.right(); ++i) {
+                int ind = i + j * area.width();
+                int t = theirs.cells[ind];
+                if (t >= 0) t = rT[t];
+                if (take_all) {
+                    out[ind] = t;
+                    continue;
+                }
+                int o = out[ind];
+                int b = base.cells[ind];
+                if (b >= 0) b = rB[b];
+                if (o == t || t == b) continue;
+                if (o == b) {
+                    out[ind] = t;
+                } else {
+                    conflict.region |= QRect(i, j, 1, 1);
+                    ++conflict.cells;
+                }
+            }
+        }
+        if (conflict.cells)
+            conflicts << conflict;
+    }
+    return conflicts;
+}
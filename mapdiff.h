@@ -0,0 +1,69 @@
+/*
+ * \file mapdiff.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Chunk-hash based diff and three-way merge of map files.
+ *
+ * Cells are compared in square chunks: chunks with equal hashes are skipped
+ * and only the rest is compared cell by cell. Tile ids of different files are
+ * matched by tile identity (path, or sheet and index), not by number.
+ **/
+#ifndef MAPDIFF_H
+#define MAPDIFF_H
+
+#include "mapfile.h"
+
+#include <QHash>
+#include <QRect>
+#include <QSize>
+
+#define MAPDIFF_CHUNK_SIZE 64
+
+/*!
+ * \brief Union of the tile tables of several maps.
+ */
+class TileTable
+{
+public:
+    QVector<int> add(MapFile const & map);
+    void exportTo(MapFile & map) const;
+    inline int size() const { return mTiles.size(); }
+    inline QString const & key(int id) const { return mKeys[id]; }
+
+private:
+    QStringList mKeys;
+    QHash<QString, int> mIndex;
+    QVector<QJsonValue> mTiles;
+    QJsonArray mSheets;
+    QHash<QString, int> mSheetIndex;
+};
+
+struct CellChange {
+    int x, y;
+    int before, after; // ids in the diff's tile table
+};
+
+struct MapDiff {
+    TileTable table;
+    QVector<int> remapA, remapB; // tile id of a file -> id in the table
+    QSize sizeA, sizeB;
+    int chunks, changedChunks;
+    QVector<QRect> regions;      // bounding rectangles of changes, one per changed chunk
+    QVector<CellChange> cells;   // in the area common to both maps
+    inline bool sizeChanged() const { return sizeA != sizeB; }
+    inline bool isEmpty() const { return !sizeChanged() && cells.isEmpty(); }
+};
+
+struct MergeConflict {
+    QRect region; // in cells
+    int cells;    // number of conflicting cells in the region
+    QString key;  // of other map data changed on both sides (e.g. "objects"), empty for cells
+    MergeConflict(): cells(0) {}
+};
+
+QVector<quint64> hashChunks(QVector<int> const & cells, int stride, QSize const & area, QVector<int> const & remap, int chunkSize = MAPDIFF_CHUNK_SIZE);
+MapDiff diffMaps(MapFile const & a, MapFile const & b);
+QVector<MergeConflict> mergeExtra(MapFile const & base, QVector<int> const & rB, MapFile const & ours, QVector<int> const & rO,
+                                  MapFile const & theirs, QVector<int> const & rT, MapFile & result);
+QVector<MergeConflict> mergeMaps(MapFile const & base, MapFile const & ours, MapFile const & theirs, MapFile & result);
+
+#endif // MAPDIFF_H
@@ -0,0 +1,1429 @@
+/*
+ * \file mapdocument.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of the map document.
+ **/
+#include "mapdocument.h"
+#include "runtime/maprt.h"
+
+#include <QMessageBox>
+#include <QJsonValue>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <QFile>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QtConcurrent>
+
+#define EXPORT_CELLS_BLOCK 65536 // cells translated to exported tile ids and written at once
+
+/*!
+ * \brief An undoable change of arbitrary cells, e.g. a whole brush stroke.
+ */
+class PaintCommand : public QUndoCommand
+{
+public:
+    PaintCommand(MapDocument * doc, QString const & text, QVector<int> const & indices, QVector<int> const & before, QVector<int> const & after, QUndoCommand * parent = NULL):
+        QUndoCommand(text, parent), mDoc(doc), mIndices(indices), mBefore(before), mAfter(after), mPainted(true) {}
+    void undo() { mDoc->applyCells(mIndices, mBefore); }
+    void redo() {
+        // the first redo comes from QUndoStack::push, when cells are already painted
+        if (mPainted)
+            mPainted = false;
+        else
+            mDoc->applyCells(mIndices, mAfter);
+    }
+
+private:
+    MapDocument * mDoc;
+    QVector<int> mIndices, mBefore, mAfter;
+    bool mPainted;
+};
+
+/*!
+ * \brief An undoable change of a rectangle of cells, e.g. a fill. Only previous tiles are kept
+ * until the first undo, which takes the current ones for redo.
+ *
+ * A part of a command with several children: they are undone in reverse order, so every
+ * child takes for redo the state which the children after it have left.
+ */
+class RectCommand : public QUndoCommand
+{
+public:
+    RectCommand(MapDocument * doc, QRect const & area, QVector<int> const & before, QUndoCommand * parent):
+        QUndoCommand(parent), mDoc(doc), mArea(area), mBefore(before), mPainted(true) {}
+    void undo() {
+        mAfter = mDoc->cellsIn(mArea);
+        mDoc->applyCellsIn(mArea, mBefore);
+    }
+    void redo() {
+        // the first redo comes from QUndoStack::push, when cells are already painted
+        if (mPainted)
+            mPainted = false;
+        else
+            mDoc->applyCellsIn(mArea, mAfter);
+    }
+
+private:
+    MapDocument * mDoc;
+    QRect mArea;
+    QVector<int> mBefore, mAfter; // row-major
+    bool mPainted;
+};
+
+/*!
+ * \brief An undoable change of static objects: added ones are invalid before, removed ones after.
+ */
+class ObjectsCommand : public QUndoCommand
+{
+public:
+    ObjectsCommand(MapDocument * doc, QString const & text, QVector<int> const & ids, QVector<MapObject> const & before, QVector<MapObject> const & after):
+        QUndoCommand(text), mDoc(doc), mIds(ids), mBefore(before), mAfter(after), mApplied(true) {}
+    void undo() { mDoc->applyObjects(mIds, mBefore); }
+    void redo() {
+        // the first redo comes from QUndoStack::push, when objects are already changed
+        if (mApplied)
+            mApplied = false;
+        else
+            mDoc->applyObjects(mIds, mAfter);
+    }
+
+private:
+    MapDocument * mDoc;
+    QVector<int> mIds;
+    QVector<MapObject> mBefore, mAfter;
+    bool mApplied;
+};
+
+MapDocument::MapDocument(QObject *parent) :
+    QObject(parent),
+    mRows(0),
+    mCols(0),
+    mTileSize(-1, -1),
+    mUndoStack(new QUndoStack(this)),
+    mAutoTiling(false)
+{
+    mAnimationClock.start();
+}
+
+TileAnimation::TileAnimation(QVector<int> const & f, QVector<int> const & d) :
+    frames(f),
+    durations(d),
+    length(0)
+{
+    for(int i = 0; i < durations.size(); ++i)
+        length += durations[i];
+}
+
+/*!
+ * \brief Index of the frame shown at a time.
+ * \param time Milliseconds since any moment common to all animations.
+ */
+int TileAnimation::frameAt(qint64 time) const
+{
+    if (length <= 0) return 0;
+    int t = int(time % length);
+    int i = 0;
+    while (t >= durations[i]) t -= durations[i++];
+    return i;
+}
+
+/*!
+ * \brief Milliseconds left until the next frame is shown.
+ */
+int TileAnimation::untilNextFrame(qint64 time) const
+{
+    if (length <= 0 || frames.size() < 2) return -1;
+    int t = int(time % length);
+    int i = 0;
+    while (t >= durations[i]) t -= durations[i++];
+    return durations[i] - t;
+}
+
+void MapDocument::setMapSize(int rows, int cols)
+{
+    if (rows == mRows && cols == mCols) return;
+
+    emit aboutToReset();
+    mUndoStack->clear();
+
+    QVector<int> newCells(rows * cols);
+    newCells.fill(-1);
+    if (!mCells.isEmpty()) {
+        int i, j;
+        int mrow = qMin<int>(rows, mRows);
+        int mcol = qMin<int>(cols, mCols);
+        for(i = 0; i < mcol; ++i) {
+            for(j = 0; j < mrow; ++j)
+                newCells[i + j * cols] = mCells[i + j * mCols];
+        }
+    }
+    mCells = newCells;
+    mRows = rows;
+    mCols = cols;
+    rebuildUsage();
+    emit mapResized();
+}
+
+/*!
+ * \brief Take everything needed to save the map, to be written by writeMapSnapshot() on another thread
+ * while the map is being edited. Cells are not copied until they change.
+ *
+ * Tiles which are not used by cells, objects, animations or auto-tiling rules are not written,
+ * the rest are renumbered (see compactRemap()).
+ * \param filename Output file, its extension selects the format.
+ */
+MapSnapshot MapDocument::snapshot(QString const & filename) const
+{
+    QJsonObject jsn_map;
+    QJsonObject jsn_tiles;
+
+    QJsonArray jsn_sheets;
+
+    QVector<int> remap, sheetRemap;
+    compactRemap(remap, sheetRemap);
+
+    for(int i = 0; i < mSheets.size(); ++i) {
+        if (sheetRemap[i] < 0) continue;
+        QJsonObject jsn_sheet;
+        jsn_sheet.insert("file", QJsonValue(mSheets[i].fileName));
+        jsn_sheet.insert("tileWidth", QJsonValue(mSheets[i].tileSize.width()));
+        jsn_sheet.insert("tileHeight", QJsonValue(mSheets[i].tileSize.height()));
+        jsn_sheet.insert("margin", QJsonValue(mSheets[i].margin));
+        jsn_sheet.insert("spacing", QJsonValue(mSheets[i].spacing));
+        jsn_sheets.push_back(jsn_sheet);
+    }
+
+    for(int i = 0; i < mTiles.size(); ++i) {
+        if (remap[i] < 0) continue;
+        QString index = QString("%1").arg(remap[i]);
+        if (mTiles[i].isFromSheet()) {
+            QJsonObject jsn_ref;
+            jsn_ref.insert("sheet", QJsonValue(sheetRemap[mTiles[i].sheet]));
+            jsn_ref.insert("index", QJsonValue(mTiles[i].index));
+            jsn_tiles.insert(index, jsn_ref);
+        } else {
+            jsn_tiles.insert(index, QJsonValue(mTiles[i].fileName));
+        }
+    }
+
+    jsn_map.insert("rows", QJsonValue(mRows));
+    jsn_map.insert("cols", QJsonValue(mCols));
+    if (!jsn_sheets.isEmpty())
+        jsn_map.insert("sheets", jsn_sheets);
+    jsn_map.insert("tiles", jsn_tiles);
+
+    if (mObjects.count()) {
+        QJsonObject jsn_objects;
+        QJsonArray jsn_items;
+        QVector<int> ids = mObjects.ids();
+        for(QVector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+            MapObject const & o = mObjects.object(*it);
+            QJsonObject jsn_item;
+            jsn_item.insert("tile", QJsonValue(remap[o.tile]));
+            jsn_item.insert("x", QJsonValue(o.pos.x()));
+            jsn_item.insert("y", QJsonValue(o.pos.y()));
+            if (!o.type.isEmpty())
+                jsn_item.insert("type", QJsonValue(o.type));
+            jsn_items.push_back(jsn_item);
+        }
+        jsn_objects.insert("bucketSize", QJsonValue(mObjects.bucketSize()));
+        jsn_objects.insert("items", jsn_items);
+        jsn_map.insert("objects", jsn_objects);
+    }
+
+    if (!mAnimations.isEmpty()) {
+        QJsonObject jsn_animations;
+        for(QHash<int, TileAnimation>::const_iterator it = mAnimations.begin(); it != mAnimations.end(); ++it) {
+            if (remap[it.key()] < 0) continue;
+            QJsonArray jsn_frames;
+            for(int f = 0; f < it.value().frames.size(); ++f) {
+                QJsonObject jsn_frame;
+                jsn_frame.insert("tile", QJsonValue(remap[it.value().frames[f]]));
+                jsn_frame.insert("duration", QJsonValue(it.value().durations[f]));
+                jsn_frames.push_back(jsn_frame);
+            }
+            jsn_animations.insert(QString("%1").arg(remap[it.key()]), jsn_frames);
+        }
+        if (!jsn_animations.isEmpty())
+            jsn_map.insert("animations", jsn_animations);
+    }
+
+    if (!mAutoTileRules.isEmpty())
+        jsn_map.insert("autotile", mAutoTileRules.toJson());
+
+    MapSnapshot snapshot;
+    snapshot.format = MapSnapshot::formatFor(filename);
+    snapshot.rows = mRows;
+    snapshot.cols = mCols;
+    snapshot.cells = mCells;
+    snapshot.remap = remap;
+    snapshot.map = jsn_map;
+    return snapshot;
+}
+
+namespace {
+
+/*!
+ * \brief Write data at an offset of a file which is written sequentially, the gap before it is zero-filled.
+ */
+bool writeSection(QFile & qf, quint64 offset, char const * data, qint64 size)
+{
+    if (quint64(qf.pos()) > offset) return false;
+    QByteArray padding(int(offset - qf.pos()), '\0');
+    if (qf.write(padding) != padding.size()) return false;
+    return size <= 0 || qf.write(data, size) == size;
+}
+
+} // namespace
+
+/*!
+ * \brief Write the map in the packed layout of runtime/maprt.h, which games use without parsing.
+ *
+ * Unused tiles are left out and the rest are renumbered as in saved maps (see compactRemap()),
+ * so cells have the same tile ids as in the map file.
+ * \param filename Output file.
+ * \param chunkSize Side of a chunk in cells for the chunk index, 0 to omit the index.
+ */
+bool MapDocument::exportRuntime(QString const & filename, int chunkSize) const
+{
+    QVector<int> remap, sheetRemap;
+    QVector<maprt::TileRect> tiles(compactRemap(remap, sheetRemap));
+
+    // images: used sheets go first, then every distinct standalone tile file
+
+    QList<QByteArray> paths;
+    for(int i = 0; i < mSheets.size(); ++i) {
+        if (sheetRemap[i] >= 0)
+            paths << mSheets[i].fileName.toUtf8();
+    }
+
+    QHash<QString, int> standalone;
+    for(int i = 0; i < mTiles.size(); ++i) {
+        if (remap[i] < 0) continue;
+        MapTile const & t = mTiles[i];
+        QRect r;
+        int image;
+        if (t.isFromSheet()) {
+            r = mSheets[t.sheet].tileRect(t.index);
+            image = sheetRemap[t.sheet];
+        } else {
+            r = QRect(QPoint(0, 0), mTileSize);
+            QHash<QString, int>::const_iterator it = standalone.find(t.fileName);
+            if (it == standalone.end()) {
+                image = paths.size();
+                standalone.insert(t.fileName, image);
+                paths << t.fileName.toUtf8();
+            } else {
+                image = it.value();
+            }
+        }
+        maprt::TileRect & tr = tiles[remap[i]];
+        tr.image = image;
+        tr.x = r.x();
+        tr.y = r.y();
+        tr.w = r.width();
+        tr.h = r.height();
+    }
+
+    QVector<maprt::ImageRef> images(paths.size());
+    QByteArray strings;
+    for(int i = 0; i < paths.size(); ++i) {
+        images[i].path = strings.size();
+        images[i].length = paths[i].size();
+        strings += paths[i];
+        strings += '\0';
+    }
+
+    // chunk index
+
+    if (chunkSize < 0) chunkSize = 0;
+    int chunkCols = maprt::chunksAlong(mCols, chunkSize);
+    int chunkRows = maprt::chunksAlong(mRows, chunkSize);
+    QVector<quint32> chunks(chunkCols * chunkRows, 0);
+    if (chunkSize) {
+        for(int j = 0; j < mRows; ++j) {
+            for(int i = 0; i < mCols; ++i) {
+                if (mCells[i + j * mCols] >= 0)
+                    ++chunks[i / chunkSize + (j / chunkSize) * chunkCols];
+            }
+        }
+    }
+
+    // layout
+
+    maprt::Header h;
+    memcpy(h.magic, "MAPR", 4);
+    h.byteOrder = MAPRT_BYTE_ORDER_MARK;
+    h.version = MAPRT_VERSION;
+    h.rows = mRows;
+    h.cols = mCols;
+    h.tileWidth = qMax(0, mTileSize.width());
+    h.tileHeight = qMax(0, mTileSize.height());
+    h.tileCount = tiles.size();
+    h.imageCount = images.size();
+    h.chunkSize = chunkSize;
+    h.cellsOffset = maprt::alignUp(sizeof(maprt::Header));
+    h.tilesOffset = maprt::alignUp(h.cellsOffset + quint64(mCells.size()) * sizeof(qint32));
+    h.imagesOffset = maprt::alignUp(h.tilesOffset + quint64(tiles.size()) * sizeof(maprt::TileRect));
+    h.chunksOffset = maprt::alignUp(h.imagesOffset + quint64(images.size()) * sizeof(maprt::ImageRef));
+    h.stringsOffset = maprt::alignUp(h.chunksOffset + quint64(chunks.size()) * sizeof(quint32));
+    h.fileSize = h.stringsOffset + strings.size();
+    if (!chunkSize) h.chunksOffset = 0;
+
+    // written section by section, the file may be larger than a QByteArray can hold
+
+    QFile qf(filename);
+    if (!qf.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    bool ok = writeSection(qf, 0, reinterpret_cast<char const *>(&h), sizeof(h))
+        && writeSection(qf, h.cellsOffset, NULL, 0);
+
+    // cells are translated block by block, so that the map is not copied as a whole
+    QVector<qint32> block;
+    for(int first = 0; ok && first < mCells.size(); first += EXPORT_CELLS_BLOCK) {
+        int count = qMin(EXPORT_CELLS_BLOCK, mCells.size() - first);
+        block.resize(count);
+        int const * cells = mCells.constData() + first;
+        for(int k = 0; k < count; ++k)
+            block[k] = cells[k] >= 0 ? remap[cells[k]] : -1;
+        qint64 size = qint64(count) * sizeof(qint32);
+        ok = qf.write(reinterpret_cast<char const *>(block.constData()), size) == size;
+    }
+
+    ok = ok && writeSection(qf, h.tilesOffset, reinterpret_cast<char const *>(tiles.constData()), qint64(tiles.size()) * sizeof(maprt::TileRect))
+        && writeSection(qf, h.imagesOffset, reinterpret_cast<char const *>(images.constData()), qint64(images.size()) * sizeof(maprt::ImageRef))
+        && (!chunkSize || writeSection(qf, h.chunksOffset, reinterpret_cast<char const *>(chunks.constData()), qint64(chunks.size()) * sizeof(quint32)))
+        && writeSection(qf, h.stringsOffset, strings.constData(), strings.size());
+
+    qf.close();
+    return ok;
+}
+
+/*!
+ * \brief Replace the map by a map file.
+ * \throw QString with the error description, the current map is kept then.
+ */
+void MapDocument::loadMap(QString const & filename)
+{
+    try {
+        readMap(filename);
+    } catch (QString &) {
+        // images of the rejected file are in the tile cache already
+        retainCachedTiles();
+        throw;
+    }
+}
+
+void MapDocument::readMap(QString const & filename) {
+    // read file
+
+    QFile qf(filename);
+    if (!qf.open(QIODevice::ReadOnly)) throw qf.errorString();
+
+    QByteArray jsn_in = qf.readAll();
+    qf.close();
+    if (jsn_in.isEmpty()) throw QString("Empty file");
+
+    // parse file
+
+    QJsonDocument jsn_doc;
+    if (jsn_in.startsWith("qbjs")) {
+        jsn_doc = QJsonDocument::fromBinaryData(jsn_in);
+    } else {
+        jsn_doc = QJsonDocument::fromJson(unpackMapData(jsn_in));
+    }
+    if (jsn_doc.isNull()) throw QString("Failed to validate JSON data");
+    if (!jsn_doc.isObject()) throw QString("Top level JSON value is not an object");
+    QJsonObject jsn_map = jsn_doc.object();
+
+    // load generic map info
+
+    QJsonObject::const_iterator it;
+    it = jsn_map.find("rows");
+    if (it == jsn_map.end()) throw QString("File not contains 'rows'");
+    if (!it.value().isDouble()) throw QString("'rows' is not a number");
+    int rows = int(it.value().toDouble());
+
+    it = jsn_map.find("cols");
+    if (it == jsn_map.end()) throw QString("File not contains 'cols'");
+    if (!it.value().isDouble()) throw QString("'cols' is not a number");
+    int cols = int(it.value().toDouble());
+
+    // load sprite sheets (optional), each one is decoded only once
+
+    QVector<TileSheet> sheets;
+    QVector<QImage> sheetImages; // decoded for hashing of tiles only, the cache keeps sheets encoded
+    QSize tileSize(-1, -1);
+    it = jsn_map.find("sheets");
+    if (it != jsn_map.end()) {
+        if (!it.value().isArray()) throw QString("'sheets' is not an array");
+        QJsonArray jsn_sheets = it.value().toArray();
+        for(QJsonArray::const_iterator i = jsn_sheets.begin(); i != jsn_sheets.end(); ++i) {
+            if (!(*i).isObject()) throw QString("Sheet is not an object");
+            QJsonObject jsn_sheet = (*i).toObject();
+            if (!jsn_sheet.value("file").isString()) throw QString("Incorrect sheet's path");
+            QString fname = jsn_sheet.value("file").toString();
+            QSize sheetTileSize(int(jsn_sheet.value("tileWidth").toDouble()), int(jsn_sheet.value("tileHeight").toDouble()));
+            if (sheetTileSize.isEmpty()) throw QString("Incorrect sheet's tile size");
+            if (tileSize.isEmpty()) {
+                tileSize = sheetTileSize;
+            } else if (tileSize != sheetTileSize) {
+                throw QString("Tile's dimensions not same");
+            }
+            QImage im;
+            QByteArray key = loadSheetImage(fname, im);
+            if (key.isEmpty()) throw QString("Can't open image");
+            sheets << TileSheet(fname, key, im.size(), sheetTileSize,
+                                int(jsn_sheet.value("margin").toDouble()), int(jsn_sheet.value("spacing").toDouble()));
+            sheetImages << im;
+        }
+    }
+
+    // load tiles, keys are sorted as strings ("10" < "2") so they are placed by value
+
+    it = jsn_map.find("tiles");
+    if (it == jsn_map.end()) throw QString("File not contains 'tiles'");
+    if (!it.value().isObject()) throw QString("'cells' is not an object");
+    QJsonObject jsn_tiles = it.value().toObject();
+    QVector<MapTile> tiles(jsn_tiles.size());
+    QHash<QByteArray, QByteArray> fileHashes = mFileHashes;
+    for(QJsonObject::const_iterator i = jsn_tiles.begin(); i != jsn_tiles.end(); ++i) {
+        bool ok = false;
+        int tile_id = i.key().toInt(&ok);
+        if (!ok || tile_id < 0 || tile_id >= tiles.size() || tiles[tile_id].isValid()) throw QString("Non-monotonic tile keys");
+        if (i.value().isObject()) {
+            QJsonObject jsn_ref = i.value().toObject();
+            int sheet_id = int(jsn_ref.value("sheet").toDouble(-1));
+            int index = int(jsn_ref.value("index").toDouble(-1));
+            if (sheet_id < 0 || sheet_id >= sheets.size()) throw QString("Incorrect tile's sheet");
+            if (index < 0 || index >= sheets[sheet_id].count()) throw QString("Incorrect tile's index in sheet");
+            QString fname = QString("%1#%2").arg(sheets[sheet_id].fileName).arg(index);
+            tiles[tile_id] = addSheetTile(fname, sheet_id, sheets[sheet_id], sheetImages[sheet_id], index);
+        } else {
+            if (!i.value().isString()) throw QString("Incorrect tile's path");
+            QSize size;
+            QByteArray hash = loadTileImage(i.value().toString(), fileHashes, size);
+            if (hash.isEmpty()) throw QString("Can't open image");
+            if (tileSize.isEmpty()) {
+                tileSize = size;
+            } else if (tileSize != size) {
+                throw QString("Tile's dimensions not same");
+            }
+            tiles[tile_id] = MapTile(i.value().toString(), hash);
+        }
+    }
+
+    // load cells
+
+    QVector<int> cells(cols * rows);
+    it = jsn_map.find("cells");
+    if (it == jsn_map.end()) throw QString("File not contains 'cells'");
+    if (!it.value().isArray()) throw QString("'cells' is not an array");
+    QJsonArray jsn_cells = it.value().toArray();
+    if (jsn_cells.size() != cols * rows) throw QString("Incorrect 'cells' length");
+    int index = -1;
+    for(QJsonArray::const_iterator i = jsn_cells.begin(); i != jsn_cells.end(); ++i) {
+        if (!(*i).isDouble()) throw QString("Not number in 'cells'");
+        int val = int((*i).toDouble());
+        if (val < -1 || val >= tiles.size()) throw QString("Incorrect range in 'cells'");
+        if (val > 0 && false == tiles[val].isValid()) throw QString("Incorrect link in 'cells'");
+        cells[++index] = val;
+    }
+
+    // load static objects (optional)
+
+    ObjectLayer objects;
+    it = jsn_map.find("objects");
+    if (it != jsn_map.end()) {
+        if (!it.value().isObject()) throw QString("'objects' is not an object");
+        QJsonObject jsn_objects = it.value().toObject();
+        if (jsn_objects.value("bucketSize").isDouble())
+            objects = ObjectLayer(int(jsn_objects.value("bucketSize").toDouble()));
+        if (!jsn_objects.value("items").isArray()) throw QString("'items' of objects is not an array");
+        QJsonArray jsn_items = jsn_objects.value("items").toArray();
+        for(QJsonArray::const_iterator i = jsn_items.begin(); i != jsn_items.end(); ++i) {
+            if (!(*i).isObject()) throw QString("Object is not an object");
+            QJsonObject jsn_item = (*i).toObject();
+            int tile = int(jsn_item.value("tile").toDouble(-1));
+            if (tile < 0 || tile >= tiles.size()) throw QString("Incorrect object's tile");
+            QPointF pos(jsn_item.value("x").toDouble(), jsn_item.value("y").toDouble());
+            objects.add(MapObject(tile, pos, jsn_item.value("type").toString()));
+        }
+    }
+    objects.setItemSize(tileSize);
+
+    // load auto-tiling rules (optional)
+
+    AutoTileRules autoTileRules;
+    it = jsn_map.find("autotile");
+    if (it != jsn_map.end()) {
+        if (!it.value().isObject()) throw QString("'autotile' is not an object");
+        autoTileRules.fromJson(it.value().toObject());
+    }
+
+    // load animations (optional): frame sequences of tiles, keyed by the tile placed in cells
+
+    QHash<int, TileAnimation> animations;
+    it = jsn_map.find("animations");
+    if (it != jsn_map.end()) {
+        if (!it.value().isObject()) throw QString("'animations' is not an object");
+        QJsonObject jsn_animations = it.value().toObject();
+        for(QJsonObject::const_iterator i = jsn_animations.begin(); i != jsn_animations.end(); ++i) {
+            bool ok = false;
+            int tile_id = i.key().toInt(&ok);
+            if (!ok || tile_id < 0 || tile_id >= tiles.size()) throw QString("Incorrect animated tile");
+            if (!i.value().isArray()) throw QString("Animation is not an array");
+            QJsonArray jsn_frames = i.value().toArray();
+            QVector<int> frames, durations;
+            for(QJsonArray::const_iterator f = jsn_frames.begin(); f != jsn_frames.end(); ++f) {
+                QJsonObject jsn_frame = (*f).toObject();
+                int frame = int(jsn_frame.value("tile").toDouble(-1));
+                int duration = int(jsn_frame.value("duration").toDouble(0));
+                if (frame < 0 || frame >= tiles.size()) throw QString("Incorrect tile of animation frame");
+                if (duration <= 0) throw QString("Incorrect duration of animation frame");
+                frames << frame;
+                durations << duration;
+            }
+            if (!frames.isEmpty())
+                animations.insert(tile_id, TileAnimation(frames, durations));
+        }
+    }
+
+    // if everything is fine
+    emit aboutToReset();
+    mUndoStack->clear();
+    mCells = cells;
+    mTiles = tiles;
+    mSheets = sheets;
+    mFileHashes = fileHashes;
+    retainCachedTiles();
+    mRows = rows;
+    mCols = cols;
+    mTileSize = tileSize;
+    mObjects = objects;
+    mAnimations = animations;
+    mAutoTileRules = autoTileRules;
+    compileAutoTileRules();
+    rebuildUsage();
+
+    emit mapLoaded();
+}
+
+bool MapDocument::addTiles(QStringList const & files)
+{
+    QSize tileSize = mTileSize;
+    QVector<MapTile> tiles;
+    QHash<QByteArray, QByteArray> fileHashes = mFileHashes;
+
+    QStringList list = files;
+    for (QStringList::Iterator it = list.begin(); it != list.end(); ++it) {
+        QSize size;
+        QByteArray hash = loadTileImage(*it, fileHashes, size);
+
+        if (!hash.isEmpty()) {
+            qDebug() << "Loading tile: " << *it << " / " << size;
+            if (tileSize.isEmpty()) {
+                tileSize = size;
+            } else if (tileSize != size) {
+                QMessageBox msg;
+                msg.setInformativeText("Operation canceled due to errors");
+                QString s = QString("Tile in file %1 have dimensions %2x%3 while expected tile size is %4x%5").arg(*it).arg(size.width()).arg(size.height()).arg(tileSize.width()).arg(tileSize.height());
+                msg.setText(s);
+                msg.setIcon(QMessageBox::Critical);
+                msg.exec();
+                retainCachedTiles();
+                return false; // to do: maybe just throw an exception?
+            }
+            tiles << MapTile(*it, hash);
+        } else {
+            QMessageBox msg(QMessageBox::Warning, "Cannot read file", "Failed to read file " + *it);
+            msg.exec();
+        }
+    }
+
+    // If succeed
+    if (mTileSize.isEmpty()) {
+        mTileSize = tileSize;
+        mObjects.setItemSize(mTileSize);
+    }
+    mTiles += tiles;
+    mFileHashes = fileHashes;
+    mUsage.setTilesCount(mTiles.size());
+    compileAutoTileRules();
+
+    emit tilesChanged();
+    return true;
+}
+
+/*!
+ * \brief Digest of pixels, the same for tiles which look the same regardless of their files.
+ */
+QByteArray MapDocument::pixelHash(QImage const & im)
+{
+    QCryptographicHash h(QCryptographicHash::Sha1);
+    qint32 dims[3] = { im.width(), im.height(), im.format() };
+    h.addData(reinterpret_cast<char const *>(dims), sizeof(dims));
+    int line = im.width() * im.depth() / 8; // without padding at the end of scanlines
+    for(int y = 0; y < im.height(); ++y)
+        h.addData(reinterpret_cast<char const *>(im.constScanLine(y)), line);
+    return h.result();
+}
+
+/*!
+ * \brief Read a tile file into the tile cache. Byte-identical files are not decoded again
+ * and pixel-identical images share one cache entry (and buffer).
+ * \param fileHashes Known files, updated with this one.
+ * \param size Receives the size of the tile.
+ * \return Digest of the tile's pixels, which is its key in the cache, or empty if the file cannot be read.
+ */
+QByteArray MapDocument::loadTileImage(QString const & fname, QHash<QByteArray, QByteArray> & fileHashes, QSize & size)
+{
+    QFile qf(fname);
+    if (!qf.open(QIODevice::ReadOnly)) return QByteArray();
+    QByteArray data = qf.readAll();
+    qf.close();
+
+    QByteArray fileHash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+    QHash<QByteArray, QByteArray>::const_iterator f = fileHashes.find(fileHash);
+    if (f != fileHashes.end() && mTileCache.contains(f.value())) {
+        size = mTileCache.size(f.value());
+        return f.value();
+    }
+
+    QImage im = TileCache::decode(data);
+    if (im.isNull()) return QByteArray();
+    QByteArray hash = pixelHash(im);
+    fileHashes.insert(fileHash, hash);
+    mTileCache.insert(hash, im, data);
+    size = im.size();
+    return hash;
+}
+
+/*!
+ * \brief Read a sprite sheet into the tile cache. Only the encoded sheet is kept, its tiles are cached one by one (see addSheetTile()).
+ * \param im Receives decoded pixels of the sheet.
+ * \return Key of the sheet in the cache, or empty if the file cannot be read.
+ */
+QByteArray MapDocument::loadSheetImage(QString const & fname, QImage & im)
+{
+    QFile qf(fname);
+    if (!qf.open(QIODevice::ReadOnly)) return QByteArray();
+    QByteArray data = qf.readAll();
+    qf.close();
+
+    im = TileCache::decode(data);
+    if (im.isNull()) return QByteArray();
+    QByteArray key = "sheet:" + QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+    mTileCache.insert(key, QImage(), data);
+    return key;
+}
+
+/*!
+ * \brief Make a tile of a sheet which is in the tile cache under the digest of its pixels,
+ * so pixel-identical tiles share one cache entry.
+ */
+MapDocument::MapTile MapDocument::addSheetTile(QString const & fname, int sheet_id, TileSheet const & sheet, QImage const & sheetImage, int index)
+{
+    QRect r = sheet.tileRect(index);
+    QByteArray hash = pixelHash(sheetTile(sheetImage, r));
+    mTileCache.insertPart(hash, sheet.cacheKey, r);
+    return MapTile(fname, hash, sheet_id, index);
+}
+
+/*!
+ * \brief Drop cached images which are not used by tiles or sheets anymore.
+ */
+void MapDocument::retainCachedTiles()
+{
+    QSet<QByteArray> keys;
+    for(int i = 0; i < mTiles.size(); ++i)
+        keys.insert(mTiles[i].hash);
+    for(int i = 0; i < mSheets.size(); ++i)
+        keys.insert(mSheets[i].cacheKey);
+    mTileCache.retain(keys);
+
+    QHash<QByteArray, QByteArray>::iterator it = mFileHashes.begin();
+    while (it != mFileHashes.end()) {
+        if (keys.contains(it.value()))
+            ++it;
+        else
+            it = mFileHashes.erase(it);
+    }
+}
+
+/*!
+ * \brief Get a copy of tile's pixels, e.g. for an icon. Use drawTile() for painting.
+ */
+QImage MapDocument::tileImage(int tile)
+{
+    return mTileCache.image(mTiles[tile].hash);
+}
+
+/*!
+ * \brief Draw a tile. Drawing many tiles should be wrapped in holdTilePixels(), see TileCache::holdSources().
+ */
+void MapDocument::drawTile(QPainter & painter, int x, int y, int tile)
+{
+    painter.drawImage(x, y, mTileCache.image(mTiles[tile].hash));
+}
+
+/*!
+ * \brief Keep only the first of pixel-identical tiles and point cells of the others to it.
+ * \return Number of removed tiles.
+ */
+int MapDocument::mergeDuplicateTiles()
+{
+    QHash<QByteArray, int> first;
+    QVector<int> remap(mTiles.size());
+    QVector<MapTile> tiles;
+    for(int i = 0; i < mTiles.size(); ++i) {
+        QHash<QByteArray, int>::const_iterator it = first.find(mTiles[i].hash);
+        if (it != first.end() && !mTiles[i].hash.isEmpty()) {
+            remap[i] = it.value();
+        } else {
+            remap[i] = tiles.size();
+            first.insert(mTiles[i].hash, tiles.size());
+            tiles << mTiles[i];
+        }
+    }
+
+    int removed = mTiles.size() - tiles.size();
+    if (!removed) return 0;
+
+    emit aboutToReset();
+    mUndoStack->clear();
+    for(QVector<int>::iterator it = mCells.begin(); it != mCells.end(); ++it) {
+        if (*it >= 0) *it = remap[*it];
+    }
+    mObjects.remapTiles(remap);
+    remapAnimations(remap);
+    mTiles = tiles;
+    retainCachedTiles();
+    compileAutoTileRules();
+    rebuildUsage();
+    emit tilesChanged();
+    return removed;
+}
+
+/*!
+ * \brief Import a sprite sheet: the image is decoded once and sliced into tiles which share its pixels.
+ * \param file Path to the sheet image.
+ * \param tileSize Size of a single tile in pixels, must match the size of tiles already loaded.
+ * \param margin Offset in pixels of the first tile from the sheet's border.
+ * \param spacing Gap in pixels between adjacent tiles.
+ * \return false if the sheet cannot be used.
+ */
+bool MapDocument::addTileSheet(QString const & file, QSize const & tileSize, int margin, int spacing)
+{
+    if (!mTileSize.isEmpty() && tileSize != mTileSize) {
+        QMessageBox msg;
+        msg.setInformativeText("Operation canceled due to errors");
+        QString s = QString("Sheet %1 have tile dimensions %2x%3 while expected tile size is %4x%5").arg(file).arg(tileSize.width()).arg(tileSize.height()).arg(mTileSize.width()).arg(mTileSize.height());
+        msg.setText(s);
+        msg.setIcon(QMessageBox::Critical);
+        msg.exec();
+        return false;
+    }
+
+    QImage im;
+    QByteArray key = loadSheetImage(file, im);
+    if (key.isEmpty()) {
+        QMessageBox msg(QMessageBox::Warning, "Cannot read file", "Failed to read file " + file);
+        msg.exec();
+        return false;
+    }
+
+    TileSheet sheet(file, key, im.size(), tileSize, margin, spacing);
+    int count = sheet.count();
+    if (count <= 0) {
+        retainCachedTiles();
+        QMessageBox msg(QMessageBox::Warning, "Cannot slice sheet", "No tiles fit into " + file);
+        msg.exec();
+        return false;
+    }
+
+    int sheet_id = mSheets.size();
+    mSheets << sheet;
+    mTiles.reserve(mTiles.size() + count);
+    for(int i = 0; i < count; ++i)
+        mTiles << addSheetTile(QString("%1#%2").arg(file).arg(i), sheet_id, sheet, im, i);
+    mUsage.setTilesCount(mTiles.size());
+    compileAutoTileRules();
+
+    if (mTileSize.isEmpty()) {
+        mTileSize = tileSize;
+        mObjects.setItemSize(mTileSize);
+    }
+
+    emit tilesChanged();
+    return true;
+}
+
+QRect MapDocument::TileSheet::tileRect(int index) const
+{
+    int cols = columns();
+    return QRect(
+        margin + (index % cols) * (tileSize.width() + spacing),
+        margin + (index / cols) * (tileSize.height() + spacing),
+        tileSize.width(),
+        tileSize.height());
+}
+
+/*!
+ * \brief Get a part of a sheet without copying pixels.
+ * \warning The result refers to the sheet's buffer, so it must not outlive the sheet image.
+ */
+QImage MapDocument::sheetTile(QImage const & sheet, QRect const & r)
+{
+    uchar const * bits = sheet.constBits() + r.top() * sheet.bytesPerLine() + r.left() * (sheet.depth() / 8);
+    return QImage(bits, r.width(), r.height(), sheet.bytesPerLine(), sheet.format());
+}
+
+/*!
+ * \brief List tiles with icons of the combo box's icon size, so that no full-size pixels are kept outside of the tile cache.
+ */
+void MapDocument::insertInto(QComboBox * tiles) {
+    QSize iconSize = tiles->iconSize();
+    holdTilePixels(true);
+    for(int i = 0; i < mTiles.size(); ++i) {
+        QImage icon = tileImage(i).scaled(iconSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        tiles->addItem(QIcon(QPixmap::fromImage(icon)), mTiles[i].fileName);
+    }
+    holdTilePixels(false);
+}
+
+/*!
+ * \brief Fill a rectangle of cells with one tile, as a single undo step.
+ */
+void MapDocument::fillCells(QRect const & area, int tile)
+{
+    QRect r = area & QRect(0, 0, mCols, mRows);
+    if (r.isEmpty()) return;
+
+    // the rectangle is recorded as a whole, so that filling a huge map costs one tile id per cell
+    QUndoCommand * command = new QUndoCommand(tile < 0 ? "Erase" : "Fill");
+    new RectCommand(this, r, cellsIn(r), command);
+
+    bool changed = false;
+    int i, j;
+    for(j = r.top(); j <= r.bottom(); ++j) {
+        for(i = r.left(); i <= r.right(); ++i) {
+            int ind = i + j * mCols;
+            if (mCells[ind] == tile) continue;
+            setCell(ind, tile);
+            changed = true;
+        }
+    }
+    if (changed)
+        emit cellsChanged(r);
+
+    // neighbours changed by auto-tiling belong to the same undo step
+    if (mAutoTiling) {
+        QHash<int, int> border;
+        changed = !autoTile(r, &border, r).isEmpty() || changed;
+        cellsCommand(QString(), border, command);
+    }
+
+    if (changed)
+        mUndoStack->push(command);
+    else
+        delete command;
+}
+
+/*!
+ * \brief Copy a rectangle of cells to another place, as a single undo step. Source and destination may overlap,
+ * the part of the destination outside of the map is dropped.
+ * \param move Clear the source cells which are not overwritten by the copy.
+ */
+void MapDocument::copyCells(QRect const & src, QPoint const & dst, bool move)
+{
+    QRect bounds(0, 0, mCols, mRows);
+    QRect from = src & bounds;
+    if (from.isEmpty()) return;
+
+    int i, j;
+    QVector<int> buffer = cellsIn(from);
+    QPoint offset = dst - src.topLeft();
+    QRect to = from.translated(offset) & bounds;
+
+    // both rectangles are recorded before anything changes, so they may overlap
+    QUndoCommand * command = new QUndoCommand(move ? "Move" : "Duplicate");
+    if (move) new RectCommand(this, from, buffer, command);
+    if (!to.isEmpty()) new RectCommand(this, to, cellsIn(to), command);
+
+    if (move) {
+        for(j = from.top(); j <= from.bottom(); ++j) {
+            for(i = from.left(); i <= from.right(); ++i)
+                setCell(i + j * mCols, -1);
+        }
+    }
+
+    for(j = to.top(); j <= to.bottom(); ++j) {
+        for(i = to.left(); i <= to.right(); ++i)
+            setCell(i + j * mCols, buffer[(i - offset.x() - from.left()) + (j - offset.y() - from.top()) * from.width()]);
+    }
+
+    if (move) emit cellsChanged(from);
+    if (!to.isEmpty()) emit cellsChanged(to);
+    if (mAutoTiling) {
+        QHash<int, int> border;
+        if (move) autoTile(from, &border, from);
+        autoTile(to, &border, to);
+        cellsCommand(QString(), border, command);
+    }
+    mUndoStack->push(command);
+}
+
+/*!
+ * \brief Set arbitrary cells, e.g. a part of a brush stroke or an undo step, and report their bounding rectangle once.
+ * Cells are set exactly, auto-tiling is not applied (see autoTile()).
+ * \param indices Row-major cell indices.
+ * \param values Tile ids, one per index.
+ */
+void MapDocument::applyCells(QVector<int> const & indices, QVector<int> const & values)
+{
+    QRect dirty;
+    for(int k = 0; k < indices.size(); ++k) {
+        int ind = indices[k];
+        setCell(ind, values[k]);
+        dirty |= QRect(ind % mCols, ind / mCols, 1, 1);
+    }
+    if (!dirty.isEmpty())
+        emit cellsChanged(dirty);
+}
+
+/*!
+ * \brief Tiles of a rectangle of cells, row-major.
+ */
+QVector<int> MapDocument::cellsIn(QRect const & area) const
+{
+    QVector<int> tiles;
+    tiles.reserve(area.width() * area.height());
+    for(int j = area.top(); j <= area.bottom(); ++j) {
+        int const * row = mCells.constData() + j * mCols;
+        for(int i = area.left(); i <= area.right(); ++i)
+            tiles << row[i];
+    }
+    return tiles;
+}
+
+/*!
+ * \brief Set a rectangle of cells exactly, e.g. for an undo step.
+ * \param values Tile ids, row-major (see cellsIn()).
+ */
+void MapDocument::applyCellsIn(QRect const & area, QVector<int> const & values)
+{
+    int k = 0;
+    for(int j = area.top(); j <= area.bottom(); ++j) {
+        for(int i = area.left(); i <= area.right(); ++i)
+            setCell(i + j * mCols, values[k++]);
+    }
+    if (!area.isEmpty())
+        emit cellsChanged(area);
+}
+
+/*!
+ * \brief Record cells which are already changed as a single undo step.
+ */
+void MapDocument::pushCellsChange(QString const & text, QVector<int> const & indices, QVector<int> const & before, QVector<int> const & after)
+{
+    if (indices.isEmpty()) return;
+    mUndoStack->push(new PaintCommand(this, text, indices, before, after));
+}
+
+/*!
+ * \brief Record sparse cells which are already changed, e.g. a brush stroke, as a single undo step.
+ * \param before Previous tiles of changed cells, current tiles are taken from the map.
+ */
+void MapDocument::pushCellsChange(QString const & text, QHash<int, int> const & before)
+{
+    QUndoCommand * command = cellsCommand(text, before);
+    if (command)
+        mUndoStack->push(command);
+}
+
+/*!
+ * \brief Make an undo command of sparse cells which are already changed.
+ * \param parent Command to add the result to as a child.
+ * \return NULL if no cell has changed.
+ */
+QUndoCommand * MapDocument::cellsCommand(QString const & text, QHash<int, int> const & before, QUndoCommand * parent)
+{
+    QVector<int> indices, tiles, after;
+    indices.reserve(before.size());
+    tiles.reserve(before.size());
+    after.reserve(before.size());
+    for(QHash<int, int>::const_iterator it = before.begin(); it != before.end(); ++it) {
+        if (it.value() == mCells[it.key()]) continue;
+        indices << it.key();
+        tiles << it.value();
+        after << mCells[it.key()];
+    }
+    if (indices.isEmpty()) return NULL;
+    return new PaintCommand(this, text, indices, tiles, after, parent);
+}
+
+/*!
+ * \brief Add a static object as an undo step.
+ */
+int MapDocument::addObject(MapObject const & obj)
+{
+    int id = mObjects.add(obj);
+    mUsage.addObject(obj.tile);
+    emit objectsChanged(mObjects.bounds(id));
+    mUndoStack->push(new ObjectsCommand(this, "Add object", QVector<int>() << id,
+                                        QVector<MapObject>() << MapObject(), QVector<MapObject>() << mObjects.object(id)));
+    return id;
+}
+
+/*!
+ * \brief Remove static objects as a single undo step.
+ */
+void MapDocument::removeObjects(QSet<int> const & ids)
+{
+    QVector<int> removed;
+    QVector<MapObject> before;
+    QRectF dirty;
+    for(QSet<int>::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+        if (!mObjects.object(*it).valid) continue;
+        removed << *it;
+        before << mObjects.object(*it);
+        dirty |= mObjects.bounds(*it);
+        mUsage.removeObject(mObjects.object(*it).tile);
+        mObjects.remove(*it);
+    }
+    if (removed.isEmpty()) return;
+    emit objectsChanged(dirty);
+    mUndoStack->push(new ObjectsCommand(this, "Remove objects", removed, before, QVector<MapObject>(removed.size())));
+}
+
+/*!
+ * \brief Set static objects by id, e.g. for an undo step: a valid object is brought back, an invalid one removes the object.
+ */
+void MapDocument::applyObjects(QVector<int> const & ids, QVector<MapObject> const & objects)
+{
+    QRectF dirty;
+    for(int k = 0; k < ids.size(); ++k) {
+        int id = ids[k];
+        MapObject const & current = mObjects.object(id);
+        if (current.valid) {
+            dirty |= mObjects.bounds(id);
+            mUsage.removeObject(current.tile);
+            mObjects.remove(id);
+        }
+        if (objects[k].valid) {
+            mObjects.restore(id, objects[k]);
+            mUsage.addObject(objects[k].tile);
+            dirty |= mObjects.bounds(id);
+        }
+    }
+    if (!dirty.isEmpty())
+        emit objectsChanged(dirty);
+}
+
+void MapDocument::rebuildUsage()
+{
+    mUsage.reset(mCells, mRows, mCols, mTiles.size());
+    QVector<int> ids = mObjects.ids();
+    for(QVector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+        mUsage.addObject(mObjects.object(*it).tile);
+}
+
+/*!
+ * \brief New ids of tiles and sheets which are used by cells, objects, animations or auto-tiling rules, in the same order.
+ * \param tileRemap Receives the new id of every tile, -1 for unused ones.
+ * \param sheetRemap Receives the new id of every sheet, -1 for sheets without used tiles.
+ * \return Number of used tiles.
+ */
+int MapDocument::compactRemap(QVector<int> & tileRemap, QVector<int> & sheetRemap) const
+{
+    QVector<bool> used(mTiles.size(), false);
+    for(int i = 0; i < mTiles.size(); ++i)
+        used[i] = mUsage.isUsed(i);
+    // frames of used animations are used too
+    for(QHash<int, TileAnimation>::const_iterator it = mAnimations.begin(); it != mAnimations.end(); ++it) {
+        if (!mUsage.isUsed(it.key())) continue;
+        for(int f = 0; f < it.value().frames.size(); ++f)
+            used[it.value().frames[f]] = true;
+    }
+    // and variants of auto-tiling rules, which edits may place later
+    QVector<int> variants = mAutoTileRules.variantTiles();
+    for(int i = 0; i < variants.size(); ++i)
+        used[variants[i]] = true;
+
+    tileRemap = QVector<int>(mTiles.size(), -1);
+    sheetRemap = QVector<int>(mSheets.size(), -1);
+    int tiles = 0;
+    for(int i = 0; i < mTiles.size(); ++i) {
+        if (!used[i]) continue;
+        tileRemap[i] = tiles++;
+        if (mTiles[i].isFromSheet())
+            sheetRemap[mTiles[i].sheet] = 0;
+    }
+    int sheets = 0;
+    for(int i = 0; i < mSheets.size(); ++i) {
+        if (sheetRemap[i] >= 0) sheetRemap[i] = sheets++;
+    }
+    return tiles;
+}
+
+/*!
+ * \brief Remove tiles which are not used by cells, objects, animations or auto-tiling rules, and sheets left without tiles.
+ * \return Number of removed tiles.
+ */
+int MapDocument::purgeUnusedTiles()
+{
+    QVector<int> remap, sheetRemap;
+    int removed = mTiles.size() - compactRemap(remap, sheetRemap);
+    if (!removed) return 0;
+
+    emit aboutToReset();
+    mUndoStack->clear();
+
+    QVector<TileSheet> sheets;
+    for(int i = 0; i < mSheets.size(); ++i) {
+        if (sheetRemap[i] >= 0) sheets << mSheets[i];
+    }
+    QVector<MapTile> tiles;
+    for(int i = 0; i < mTiles.size(); ++i) {
+        if (remap[i] < 0) continue;
+        tiles << mTiles[i];
+        if (tiles.last().isFromSheet())
+            tiles.last().sheet = sheetRemap[tiles.last().sheet];
+    }
+
+    for(QVector<int>::iterator it = mCells.begin(); it != mCells.end(); ++it) {
+        if (*it >= 0) *it = remap[*it];
+    }
+    mObjects.remapTiles(remap);
+    remapAnimations(remap);
+    mSheets = sheets;
+    mTiles = tiles;
+    retainCachedTiles();
+    compileAutoTileRules();
+    rebuildUsage();
+    emit tilesChanged();
+    return removed;
+}
+
+namespace {
+
+struct ReplaceJob {
+    int * cells;
+    int stride;
+    QRect area;
+    int from, to;
+    QVector<int> indices; // changed cells
+};
+
+void replaceInChunk(ReplaceJob & job)
+{
+    for(int j = job.area.top(); j <= job.area.bottom(); ++j) {
+        int * row = job.cells + j * job.stride;
+        for(int i = job.area.left(); i <= job.area.right(); ++i) {
+            if (row[i] == job.from) {
+                row[i] = job.to;
+                job.indices << i + j * job.stride;
+            }
+        }
+    }
+}
+
+} // namespace
+
+/*!
+ * \brief Replace a tile by another one in all cells, as a single undo step.
+ *
+ * Only chunks where the tile is present are visited, in parallel.
+ * \return Number of changed cells.
+ */
+int MapDocument::replaceTile(int from, int to)
+{
+    if (from == to || from < 0 || from >= mTiles.size() || to >= mTiles.size()) return 0;
+
+    QVector<int> chunks = mUsage.chunksWith(from);
+    if (chunks.isEmpty()) return 0;
+
+    int * cells = mCells.data(); // detach before writing from several threads
+    QVector<ReplaceJob> jobs(chunks.size());
+    for(int c = 0; c < chunks.size(); ++c) {
+        jobs[c].cells = cells;
+        jobs[c].stride = mCols;
+        jobs[c].area = mUsage.chunkArea(chunks[c]);
+        jobs[c].from = from;
+        jobs[c].to = to;
+    }
+    QtConcurrent::blockingMap(jobs, replaceInChunk);
+
+    QVector<int> indices;
+    for(int c = 0; c < jobs.size(); ++c) {
+        mUsage.replaceInChunk(chunks[c], from, to, jobs[c].indices.size());
+        indices += jobs[c].indices;
+        if (!jobs[c].indices.isEmpty())
+            emit cellsChanged(jobs[c].area);
+    }
+    pushCellsChange("Replace tile", indices, QVector<int>(indices.size(), from), QVector<int>(indices.size(), to));
+    return indices.size();
+}
+
+/*!
+ * \brief Make a tile animated: cells with it show the frames one after another.
+ * \param frames Tile ids of frames, empty to stop animating the tile.
+ * \param durations Duration of every frame in ms.
+ */
+void MapDocument::setTileAnimation(int tile, QVector<int> const & frames, QVector<int> const & durations)
+{
+    if (tile < 0 || tile >= mTiles.size()) return;
+    if (frames.isEmpty())
+        mAnimations.remove(tile);
+    else
+        mAnimations.insert(tile, TileAnimation(frames, durations));
+    emit animationsChanged();
+}
+
+void MapDocument::remapAnimations(QVector<int> const & remap)
+{
+    QHash<int, TileAnimation> animations;
+    for(QHash<int, TileAnimation>::const_iterator it = mAnimations.begin(); it != mAnimations.end(); ++it) {
+        if (remap[it.key()] < 0) continue;
+        QVector<int> frames, durations;
+        for(int f = 0; f < it.value().frames.size(); ++f) {
+            int frame = remap[it.value().frames[f]];
+            if (frame < 0) continue;
+            frames << frame;
+            durations << it.value().durations[f];
+        }
+        if (!frames.isEmpty())
+            animations.insert(remap[it.key()], TileAnimation(frames, durations));
+    }
+    mAnimations = animations;
+}
+
+/*!
+ * \brief Load auto-tiling rules, which replace the current ones and are saved with the map.
+ * \throw QString with the error description.
+ */
+void MapDocument::loadAutoTileRules(QString const & filename)
+{
+    AutoTileRules rules;
+    rules.load(filename);
+    mAutoTileRules = rules;
+    compileAutoTileRules();
+}
+
+void MapDocument::compileAutoTileRules()
+{
+    QStringList names;
+    for(int i = 0; i < mTiles.size(); ++i)
+        names << mTiles[i].fileName;
+    mAutoTileRules.compile(names);
+}
+
+/*!
+ * \brief Whether two tiles are variants of the same terrain, so that a brush does not repaint auto-tiled cells.
+ */
+bool MapDocument::isSameTerrain(int a, int b) const
+{
+    if (a == b) return true;
+    if (!mAutoTiling) return false;
+    int terrain = mAutoTileRules.terrainOf(a);
+    return terrain >= 0 && terrain == mAutoTileRules.terrainOf(b);
+}
+
+/*!
+ * \brief Pick terrain variants for edited cells and the one-cell border around them.
+ *
+ * Variants depend only on which terrain the neighbours are, and a variant keeps the
+ * terrain of a cell, so cells can be resolved in place in any order.
+ * \param area Edited cells.
+ * \param before If given, receives the previous tiles of changed cells which are not in it yet, e.g. for undo.
+ * \param recorded Cells which the caller records for undo itself, they are not added to before.
+ * \return Bounding rectangle of changed cells.
+ */
+QRect MapDocument::autoTile(QRect const & area, QHash<int, int> * before, QRect const & recorded)
+{
+    QRect r = area.adjusted(-1, -1, 1, 1) & QRect(0, 0, mCols, mRows);
+    if (r.isEmpty() || mAutoTileRules.isEmpty()) return QRect();
+
+    QRect dirty;
+    int const * cells = mCells.constData();
+    for(int j = r.top(); j <= r.bottom(); ++j) {
+        for(int i = r.left(); i <= r.right(); ++i) {
+            int ind = i + j * mCols;
+            int tile = mAutoTileRules.resolve(cells, mCols, mRows, i, j);
+            if (tile == mCells[ind]) continue;
+            if (before && !recorded.contains(i, j) && !before->contains(ind))
+                before->insert(ind, mCells[ind]);
+            setCell(ind, tile);
+            cells = mCells.constData();
+            dirty |= QRect(i, j, 1, 1);
+        }
+    }
+    if (!dirty.isEmpty())
+        emit cellsChanged(dirty);
+    return dirty;
+}
+
+namespace {
+
+struct AutoTileJob {
+    AutoTileRules const * rules;
+    int const * source; // snapshot of all cells, neighbours are read from it
+    int cols, rows;
+    QRect area;
+    QVector<int> indices, tiles; // changed cells
+};
+
+void autoTileChunk(AutoTileJob & job)
+{
+    for(int j = job.area.top(); j <= job.area.bottom(); ++j) {
+        for(int i = job.area.left(); i <= job.area.right(); ++i) {
+            int ind = i + j * job.cols;
+            int tile = job.rules->resolve(job.source, job.cols, job.rows, i, j);
+            if (tile != job.source[ind]) {
+                job.indices << ind;
+                job.tiles << tile;
+            }
+        }
+    }
+}
+
+} // namespace
+
+/*!
+ * \brief Apply auto-tiling to the whole map, chunks are resolved in parallel. The result is a single undo step.
+ * \return Number of changed cells.
+ */
+int MapDocument::autoTileMap()
+{
+    if (mAutoTileRules.isEmpty() || mCells.isEmpty()) return 0;
+
+    QVector<int> source = mCells;
+    int chunkCols = (mCols + mUsage.chunkSize() - 1) / mUsage.chunkSize();
+    int chunkRows = (mRows + mUsage.chunkSize() - 1) / mUsage.chunkSize();
+    QVector<AutoTileJob> jobs(chunkCols * chunkRows);
+    for(int c = 0; c < jobs.size(); ++c) {
+        jobs[c].rules = &mAutoTileRules;
+        jobs[c].source = source.constData();
+        jobs[c].cols = mCols;
+        jobs[c].rows = mRows;
+        jobs[c].area = mUsage.chunkArea(c);
+    }
+    QtConcurrent::blockingMap(jobs, autoTileChunk);
+
+    QVector<int> indices, before, after;
+    for(int c = 0; c < jobs.size(); ++c) {
+        indices += jobs[c].indices;
+        after += jobs[c].tiles;
+    }
+    before.reserve(indices.size());
+    for(int k = 0; k < indices.size(); ++k)
+        before << source[indices[k]];
+
+    applyCells(indices, after);
+    pushCellsChange("Auto-tile map", indices, before, after);
+    return indices.size();
+}
@@ -0,0 +1,185 @@
+/*
+ * \file mapdocument.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief A header of the map document, which is shared by all views of a map.
+ **/
+#ifndef MAPDOCUMENT_H
+#define MAPDOCUMENT_H
+
+#include <QObject>
+#include <QtGui>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QComboBox>
+#include <QUndoStack>
+#include <QElapsedTimer>
+#include "tilecache.h"
+#include "objectlayer.h"
+#include "tileusage.h"
+#include "autotile.h"
+#include "mapsave.h"
+
+/*!
+ * \brief A tile which shows other tiles in turn, e.g. water or lava.
+ */
+struct TileAnimation {
+    QVector<int> frames;    // tile ids
+    QVector<int> durations; // in ms, one per frame
+    int length;             // duration of the whole loop
+    TileAnimation(): length(0) {}
+    TileAnimation(QVector<int> const & f, QVector<int> const & d);
+    int frameAt(qint64 time) const;
+    int untilNextFrame(qint64 time) const;
+};
+
+/*!
+ * \brief Map data: cells, tiles, static objects and decoded tile pixels.
+ *
+ * All edits go through the document, which reports changed areas with signals,
+ * so every view repaints only what changed. Edits of cells and objects are undo
+ * steps; changes of the tile table or the map size clear the undo history, and
+ * tile animations and auto-tiling rules are not part of it.
+ */
+class MapDocument : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MapDocument(QObject *parent = 0);
+
+    void setMapSize(int rows, int cols);
+    MapSnapshot snapshot(QString const & filename) const;
+    void loadMap(QString const & filename);
+    bool exportRuntime(QString const & filename, int chunkSize = 32) const;
+    bool addTiles(QStringList const & files);
+    bool addTileSheet(QString const & file, QSize const & tileSize, int margin, int spacing);
+    int mergeDuplicateTiles();
+    int purgeUnusedTiles();
+    int replaceTile(int from, int to);
+    void insertInto(QComboBox * tiles);
+
+    inline int getRows() const { return mRows; }
+    inline int getCols() const { return mCols; }
+    inline QSize const & getTileSize() const { return mTileSize; }
+    inline int getTilesCount() const { return mTiles.size(); }
+    inline int cellAt(int x, int y) const { return mCells[x + y * mCols]; }
+    inline QVector<int> const & getCells() const { return mCells; }
+    inline ObjectLayer const & getObjects() const { return mObjects; }
+    inline QUndoStack * undoStack() { return mUndoStack; }
+    inline TileUsage const & getTileUsage() const { return mUsage; }
+
+    void loadAutoTileRules(QString const & filename);
+    inline bool hasAutoTileRules() const { return !mAutoTileRules.isEmpty(); }
+    inline void setAutoTiling(bool on) { mAutoTiling = on; }
+    inline bool isAutoTiling() const { return mAutoTiling; }
+    bool isSameTerrain(int a, int b) const;
+    QRect autoTile(QRect const & area, QHash<int, int> * before = NULL, QRect const & recorded = QRect());
+    int autoTileMap();
+
+    void setTileAnimation(int tile, QVector<int> const & frames, QVector<int> const & durations);
+    inline QHash<int, TileAnimation> const & getAnimations() const { return mAnimations; }
+    inline bool hasAnimations() const { return !mAnimations.isEmpty(); }
+    inline qint64 animationTime() const { return mAnimationClock.elapsed(); }
+    inline int animationFrame(int tile, qint64 time) const;
+
+    void fillCells(QRect const & area, int tile);
+    void copyCells(QRect const & src, QPoint const & dst, bool move);
+    void applyCells(QVector<int> const & indices, QVector<int> const & values);
+    QVector<int> cellsIn(QRect const & area) const;
+    void applyCellsIn(QRect const & area, QVector<int> const & values);
+    void pushCellsChange(QString const & text, QVector<int> const & indices, QVector<int> const & before, QVector<int> const & after);
+    void pushCellsChange(QString const & text, QHash<int, int> const & before);
+
+    int addObject(MapObject const & obj);
+    void removeObjects(QSet<int> const & ids);
+    void applyObjects(QVector<int> const & ids, QVector<MapObject> const & objects);
+
+    inline void setTileMemoryBudget(int megabytes) { mTileCache.setBudget(megabytes); }
+    inline TileCache const & getTileCache() const { return mTileCache; }
+    inline void holdTilePixels(bool hold) { mTileCache.holdSources(hold); }
+    QImage tileImage(int tile);
+    void drawTile(QPainter & painter, int x, int y, int tile);
+
+signals:
+    void aboutToReset(); // before cells are replaced as a whole and the undo history is cleared
+    void cellsChanged(QRect const & cells);
+    void objectsChanged(QRectF const & area);
+    void tilesChanged();
+    void mapResized();
+    void mapLoaded();
+    void animationsChanged();
+
+private:
+    int mRows, mCols;
+    QVector<int> mCells;
+    QSize mTileSize;
+
+    /*!
+     * \brief A sprite sheet: one image which is sliced into tiles of the same size.
+     */
+    struct TileSheet {
+        QByteArray cacheKey; // encoded sheet in mTileCache, which its tiles are decoded from
+        QString fileName;
+        QSize size, tileSize;
+        int margin, spacing;
+        TileSheet(): margin(0), spacing(0) {}
+        TileSheet(QString const & fname, QByteArray const & key, QSize const & sz, QSize const & ts, int m, int s): cacheKey(key), fileName(fname), size(sz), tileSize(ts), margin(m), spacing(s) {}
+        inline int columns() const { return (size.width() - 2 * margin + spacing) / (tileSize.width() + spacing); }
+        inline int rows() const { return (size.height() - 2 * margin + spacing) / (tileSize.height() + spacing); }
+        inline int count() const { return (tileSize.isEmpty() || size.isEmpty()) ? 0 : qMax(0, columns()) * qMax(0, rows()); }
+        QRect tileRect(int index) const;
+    };
+    QVector<TileSheet> mSheets;
+    static QImage sheetTile(QImage const & sheet, QRect const & r);
+
+    struct MapTile {
+        QString fileName;
+        QByteArray hash; // digest of pixels, equal for pixel-identical tiles; key of the tile in mTileCache
+        int sheet, index; // sheet is -1 for tiles loaded from their own file
+        bool valid;
+        MapTile(): sheet(-1), index(-1), valid(false) {}
+        MapTile(QString const & fname, QByteArray const & h): fileName(fname), hash(h), sheet(-1), index(-1), valid(true) {}
+        MapTile(QString const & fname, QByteArray const & h, int s, int idx): fileName(fname), hash(h), sheet(s), index(idx), valid(true) {}
+        inline bool isValid() const { return valid; }
+        inline bool isFromSheet() const { return sheet >= 0; }
+    };
+    QVector<MapTile> mTiles;
+
+    TileCache mTileCache;
+    QHash<QByteArray, QByteArray> mFileHashes; // digest of file bytes -> digest of pixels, to skip decoding of byte-identical files
+    static QByteArray pixelHash(QImage const & im);
+    QByteArray loadTileImage(QString const & fname, QHash<QByteArray, QByteArray> & fileHashes, QSize & size);
+    QByteArray loadSheetImage(QString const & fname, QImage & im);
+    MapTile addSheetTile(QString const & fname, int sheet_id, TileSheet const & sheet, QImage const & sheetImage, int index);
+    void retainCachedTiles();
+    void readMap(QString const & filename);
+
+    ObjectLayer mObjects;
+    QUndoStack * mUndoStack;
+
+    TileUsage mUsage;
+    inline void setCell(int index, int tile) { mUsage.change(index, mCells[index], tile); mCells[index] = tile; }
+    void rebuildUsage();
+    QUndoCommand * cellsCommand(QString const & text, QHash<int, int> const & before, QUndoCommand * parent = NULL);
+    int compactRemap(QVector<int> & tileRemap, QVector<int> & sheetRemap) const;
+
+    QHash<int, TileAnimation> mAnimations; // animated tile -> its frames
+    QElapsedTimer mAnimationClock;         // common to all views, so that they show the same frames
+    void remapAnimations(QVector<int> const & remap);
+
+    AutoTileRules mAutoTileRules;
+    bool mAutoTiling; // apply the rules to edits
+    void compileAutoTileRules();
+};
+
+/*!
+ * \brief Tile shown at a time instead of tile, which is tile itself if it is not animated.
+ */
+int MapDocument::animationFrame(int tile, qint64 time) const
+{
+    QHash<int, TileAnimation>::const_iterator it = mAnimations.find(tile);
+    if (it == mAnimations.end()) return tile;
+    return it.value().frames[it.value().frameAt(time)];
+}
+
+#endif // MAPDOCUMENT_H
@@ -0,0 +1,189 @@
+/*
+ * \file mapfile.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of headless map file access.
+ **/
+#include "mapfile.h"
+
+#include <QFile>
+#include <QJsonDocument>
+
+#include "mapsave.h"
+
+/*!
+ * \brief Read a map file. The format (plain-text, binary or packed JSON) is detected by contents,
+ * so files without extension (e.g. temporaries of git merge drivers) are fine.
+ * \throw QString with the error description.
+ */
+void MapFile::load(QString const & filename)
+{
+    QFile qf(filename);
+    if (!qf.open(QIODevice::ReadOnly)) throw qf.errorString();
+
+    QByteArray jsn_in = qf.readAll();
+    qf.close();
+    if (jsn_in.isEmpty()) throw QString("Empty file");
+
+    QJsonDocument jsn_doc;
+    bool is_binary = jsn_in.startsWith("qbjs");
+    bool is_packed = jsn_in.startsWith(MAPSAVE_PACKED_MAGIC);
+    if (is_binary) {
+        jsn_doc = QJsonDocument::fromBinaryData(jsn_in);
+    } else {
+        jsn_doc = QJsonDocument::fromJson(unpackMapData(jsn_in));
+    }
+    if (jsn_doc.isNull()) throw QString("Failed to validate JSON data");
+    if (!jsn_doc.isObject()) throw QString("Top level JSON value is not an object");
+    QJsonObject jsn_map = jsn_doc.object();
+
+    if (!jsn_map.value("rows").isDouble()) throw QString("'rows' is not a number");
+    if (!jsn_map.value("cols").isDouble()) throw QString("'cols' is not a number");
+    int new_rows = int(jsn_map.value("rows").toDouble());
+    int new_cols = int(jsn_map.value("cols").toDouble());
+
+    QJsonArray new_sheets;
+    if (jsn_map.contains("sheets")) {
+        if (!jsn_map.value("sheets").isArray()) throw QString("'sheets' is not an array");
+        new_sheets = jsn_map.value("sheets").toArray();
+    }
+
+    // tile keys are sorted as strings ("10" < "2"), so they are placed by value
+    if (!jsn_map.value("tiles").isObject()) throw QString("'tiles' is not an object");
+    QJsonObject jsn_tiles = jsn_map.value("tiles").toObject();
+    QVector<QJsonValue> new_tiles(jsn_tiles.size());
+    QVector<bool> seen(jsn_tiles.size(), false);
+    for(QJsonObject::const_iterator i = jsn_tiles.begin(); i != jsn_tiles.end(); ++i) {
+        bool ok = false;
+        int tile_id = i.key().toInt(&ok);
+        if (!ok || tile_id < 0 || tile_id >= new_tiles.size() || seen[tile_id]) throw QString("Non-monotonic tile keys");
+        if (!i.value().isString() && !i.value().isObject()) throw QString("Incorrect tile's path");
+        new_tiles[tile_id] = i.value();
+        seen[tile_id] = true;
+    }
+
+    if (!jsn_map.value("cells").isArray()) throw QString("'cells' is not an array");
+    QJsonArray jsn_cells = jsn_map.value("cells").toArray();
+    if (jsn_cells.size() != new_rows * new_cols) throw QString("Incorrect 'cells' length");
+    QVector<int> new_cells(jsn_cells.size());
+    int index = -1;
+    for(QJsonArray::const_iterator i = jsn_cells.begin(); i != jsn_cells.end(); ++i) {
+        if (!(*i).isDouble()) throw QString("Not number in 'cells'");
+        int val = int((*i).toDouble());
+        if (val < -1 || val >= new_tiles.size()) throw QString("Incorrect range in 'cells'");
+        new_cells[++index] = val;
+    }
+
+    jsn_map.remove("rows");
+    jsn_map.remove("cols");
+    jsn_map.remove("sheets");
+    jsn_map.remove("tiles");
+    jsn_map.remove("cells");
+
+    rows = new_rows;
+    cols = new_cols;
+    cells = new_cells;
+    tiles = new_tiles;
+    sheets = new_sheets;
+    extra = jsn_map;
+    binary = is_binary;
+    packed = is_packed;
+}
+
+/*!
+ * \brief Write the map in the format it was read in. The file is replaced only if everything is written.
+ */
+bool MapFile::save(QString const & filename, QString * error) const
+{
+    QJsonObject jsn_map = extra;
+    QJsonObject jsn_tiles;
+
+    for(int i = 0; i < tiles.size(); ++i)
+        jsn_tiles.insert(QString("%1").arg(i), tiles[i]);
+
+    jsn_map.insert("rows", QJsonValue(rows));
+    jsn_map.insert("cols", QJsonValue(cols));
+    if (!sheets.isEmpty())
+        jsn_map.insert("sheets", sheets);
+    jsn_map.insert("tiles", jsn_tiles);
+
+    MapSnapshot snapshot;
+    snapshot.format = binary ? MapSnapshot::BINARY : packed ? MapSnapshot::PACKED : MapSnapshot::TEXT;
+    snapshot.rows = rows;
+    snapshot.cols = cols;
+    snapshot.cells = cells;
+    snapshot.map = jsn_map;
+
+    QString e = writeMapSnapshot(snapshot, filename);
+    if (error) *error = e;
+    return e.isEmpty();
+}
+
+namespace {
+
+QJsonValue remappedTile(QJsonValue const & tile, QVector<int> const & remap)
+{
+    int id = int(tile.toDouble(-1));
+    if (id < 0 || id >= remap.size()) return tile;
+    return QJsonValue(remap[id]);
+}
+
+} // namespace
+
+/*!
+ * \brief Translate tile ids kept in extra ("objects" and "animations"), e.g. after the tile table was rebuilt.
+ * \param remap Old tile id -> new id.
+ */
+void MapFile::remapExtra(QVector<int> const & remap)
+{
+    if (extra.value("objects").isObject()) {
+        QJsonObject jsn_objects = extra.value("objects").toObject();
+        QJsonArray jsn_items = jsn_objects.value("items").toArray();
+        for(int i = 0; i < jsn_items.size(); ++i) {
+            QJsonObject jsn_item = jsn_items.at(i).toObject();
+            jsn_item.insert("tile", remappedTile(jsn_item.value("tile"), remap));
+            jsn_items.replace(i, jsn_item);
+        }
+        jsn_objects.insert("items", jsn_items);
+        extra.insert("objects", jsn_objects);
+    }
+
+    if (extra.value("animations").isObject()) {
+        QJsonObject jsn_animations = extra.value("animations").toObject();
+        QJsonObject jsn_remapped;
+        for(QJsonObject::const_iterator it = jsn_animations.begin(); it != jsn_animations.end(); ++it) {
+            bool ok = false;
+            int tile = it.key().toInt(&ok);
+            if (!ok || tile < 0 || tile >= remap.size()) continue;
+            QJsonArray jsn_frames = it.value().toArray();
+            for(int f = 0; f < jsn_frames.size(); ++f) {
+                QJsonObject jsn_frame = jsn_frames.at(f).toObject();
+                jsn_frame.insert("tile", remappedTile(jsn_frame.value("tile"), remap));
+                jsn_frames.replace(f, jsn_frame);
+            }
+            jsn_remapped.insert(QString("%1").arg(remap[tile]), jsn_frames);
+        }
+        extra.insert("animations", jsn_remapped);
+    }
+}
+
+QString MapFile::sheetKey(int sheet) const
+{
+    QJsonObject s = sheets.at(sheet).toObject();
+    return QString("%1?%2x%3+%4+%5")
+        .arg(s.value("file").toString())
+        .arg(int(s.value("tileWidth").toDouble()))
+        .arg(int(s.value("tileHeight").toDouble()))
+        .arg(int(s.value("margin").toDouble()))
+        .arg(int(s.value("spacing").toDouble()));
+}
+
+QString MapFile::tileKey(int tile) const
+{
+    QJsonValue const & t = tiles[tile];
+    if (t.isString()) return t.toString();
+
+    QJsonObject ref = t.toObject();
+    int sheet = int(ref.value("sheet").toDouble(-1));
+    if (sheet < 0 || sheet >= sheets.size()) return QString();
+    return QString("%1#%2").arg(sheetKey(sheet)).arg(int(ref.value("index").toDouble()));
+}
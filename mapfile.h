@@ -0,0 +1,44 @@
+/*
+ * \file mapfile.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Headless access to MapEd map files (no images are decoded).
+ **/
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QJsonValue>
+
+/*!
+ * \brief Plain contents of a map file: size, cells and the tile table as it is stored.
+ *
+ * Keys which are not handled here are kept in extra and written back untouched,
+ * except for tile ids of objects and animations, which follow remapExtra().
+ */
+struct MapFile
+{
+    int rows, cols;
+    QVector<int> cells;
+    QVector<QJsonValue> tiles; // path string or {sheet, index} reference
+    QJsonArray sheets;
+    QJsonObject extra;
+    bool binary, packed;
+
+    MapFile(): rows(0), cols(0), binary(false), packed(false) {}
+
+    void load(QString const & filename);
+    bool save(QString const & filename, QString * error = 0) const;
+    void remapExtra(QVector<int> const & remap);
+
+    /*!
+     * \brief Identity of a tile which does not depend on its id, e.g. to match tiles of two files.
+     */
+    QString tileKey(int tile) const;
+    QString sheetKey(int sheet) const;
+};
+
+#endif // MAPFILE_H
@@ -0,0 +1,154 @@
+/*
+ * \file mapsave.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of map snapshot writing.
+ **/
+#include "mapsave.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QThread>
+#include <QtConcurrent>
+#include <QtEndian>
+
+MapSnapshot::Format MapSnapshot::formatFor(QString const & filename)
+{
+    if (filename.endsWith("json")) return TEXT;
+    if (filename.endsWith("mapz")) return PACKED;
+    return BINARY;
+}
+
+namespace {
+
+struct Band {
+    MapSnapshot const * snapshot;
+    int first, count; // rows
+};
+
+inline int cellValue(MapSnapshot const & s, int v)
+{
+    return (v >= 0 && !s.remap.isEmpty()) ? s.remap[v] : v;
+}
+
+/*!
+ * \brief Frame of the packed format: big-endian length followed by qCompress() output.
+ */
+QByteArray packChunk(QByteArray const & data)
+{
+    QByteArray packed = qCompress(data);
+    uchar length[4];
+    qToBigEndian<quint32>(packed.size(), length);
+    return QByteArray(reinterpret_cast<char const *>(length), 4) + packed;
+}
+
+/*!
+ * \brief Text of cells of some rows, as a part of a JSON array; one row of the map per line.
+ */
+QByteArray serializeBand(Band const & band)
+{
+    MapSnapshot const & s = *band.snapshot;
+    QByteArray out;
+    out.reserve(band.count * s.cols * 4);
+    for(int j = band.first; j < band.first + band.count; ++j) {
+        if (j > 0) out += ",\n        ";
+        int const * row = s.cells.constData() + j * s.cols;
+        for(int i = 0; i < s.cols; ++i) {
+            if (i > 0) out += ',';
+            out += QByteArray::number(cellValue(s, row[i]));
+        }
+    }
+    return s.format == MapSnapshot::PACKED ? packChunk(out) : out;
+}
+
+inline bool writeAll(QSaveFile & qf, QByteArray const & data)
+{
+    return qf.write(data) == data.size();
+}
+
+} // namespace
+
+/*!
+ * \brief Write a map snapshot into a file, which is replaced only if everything is written.
+ *
+ * Plain-text and packed cells are serialized (and compressed) in bands of rows on the thread pool
+ * and streamed into the file in order; a few bands per thread are kept in memory at once.
+ * Binary JSON cannot be written in parts, so it is built as a whole.
+ * Safe to run on any thread.
+ * \return Error description, empty on success.
+ */
+QString writeMapSnapshot(MapSnapshot const & snapshot, QString const & filename)
+{
+    QSaveFile qf(filename);
+    if (!qf.open(QIODevice::WriteOnly))
+        return QString("Cannot open %1: %2").arg(filename).arg(qf.errorString());
+
+    if (snapshot.format == MapSnapshot::BINARY) {
+        QJsonObject jsn_map = snapshot.map;
+        QJsonArray jsn_cells;
+        for(QVector<int>::const_iterator it = snapshot.cells.begin(); it != snapshot.cells.end(); ++it)
+            jsn_cells.push_back(QJsonValue(cellValue(snapshot, *it)));
+        jsn_map.insert("cells", jsn_cells);
+        if (!writeAll(qf, QJsonDocument(jsn_map).toBinaryData()))
+            return QString("Cannot write %1: %2").arg(filename).arg(qf.errorString());
+    } else {
+        // "cells" goes last: the rest of the map is small and written by QJsonDocument
+        QByteArray head = QJsonDocument(snapshot.map).toJson();
+        head.truncate(head.lastIndexOf('}'));
+        while (!head.isEmpty() && (head.endsWith('\n') || head.endsWith(' ')))
+            head.chop(1);
+        head += snapshot.map.isEmpty() ? "\n    \"cells\": [\n        " : ",\n    \"cells\": [\n        ";
+        QByteArray tail = "\n    ]\n}\n";
+
+        bool packed = snapshot.format == MapSnapshot::PACKED;
+        bool ok = !packed || writeAll(qf, MAPSAVE_PACKED_MAGIC);
+        ok = ok && writeAll(qf, packed ? packChunk(head) : head);
+
+        int batch = qMax(1, QThread::idealThreadCount() * 4);
+        for(int row = 0; ok && snapshot.cols > 0 && row < snapshot.rows; ) {
+            QList<Band> bands;
+            for(int b = 0; b < batch && row < snapshot.rows; ++b) {
+                Band band;
+                band.snapshot = &snapshot;
+                band.first = row;
+                band.count = qMin(MAPSAVE_BAND_ROWS, snapshot.rows - row);
+                bands << band;
+                row += band.count;
+            }
+            QList<QByteArray> chunks = QtConcurrent::blockingMapped<QList<QByteArray> >(bands, serializeBand);
+            for(int c = 0; ok && c < chunks.size(); ++c)
+                ok = writeAll(qf, chunks[c]);
+        }
+
+        ok = ok && writeAll(qf, packed ? packChunk(tail) : tail);
+        if (!ok)
+            return QString("Cannot write %1: %2").arg(filename).arg(qf.errorString());
+    }
+
+    if (!qf.commit())
+        return QString("Cannot save %1: %2").arg(filename).arg(qf.errorString());
+    return QString();
+}
+
+/*!
+ * \brief Get the JSON text of a packed map, other data is returned as it is.
+ * \throw QString if packed data is damaged.
+ */
+QByteArray unpackMapData(QByteArray const & data)
+{
+    if (!data.startsWith(MAPSAVE_PACKED_MAGIC)) return data;
+
+    QByteArray out;
+    int pos = sizeof(MAPSAVE_PACKED_MAGIC) - 1;
+    while (pos < data.size()) {
+        if (data.size() - pos < 4) throw QString("Truncated packed map");
+        quint32 length = qFromBigEndian<quint32>(reinterpret_cast<uchar const *>(data.constData() + pos));
+        pos += 4;
+        if (length > quint32(data.size() - pos)) throw QString("Truncated packed map");
+        QByteArray chunk = qUncompress(data.mid(pos, int(length)));
+        if (chunk.isEmpty()) throw QString("Damaged packed map");
+        out += chunk;
+        pos += int(length);
+    }
+    return out;
+}
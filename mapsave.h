@@ -0,0 +1,44 @@
+/*
+ * \file mapsave.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Writing of map files from a snapshot, in parallel chunks and atomically.
+ **/
+#ifndef MAPSAVE_H
+#define MAPSAVE_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QString>
+#include <QVector>
+
+#define MAPSAVE_BAND_ROWS 64        // rows of cells serialized by one job
+#define MAPSAVE_PACKED_MAGIC "MAPZ" // zlib-compressed chunks of plain-text JSON
+
+/*!
+ * \brief Everything needed to write a map, independent of the document.
+ *
+ * Cells are an implicitly shared copy: taking a snapshot costs nothing and the
+ * document detaches its cells on the next edit, so it may be edited while the
+ * snapshot is written by another thread.
+ */
+struct MapSnapshot
+{
+    enum Format {
+        TEXT,   // plain-text JSON
+        BINARY, // Qt binary JSON
+        PACKED  // plain-text JSON in zlib-compressed chunks
+    };
+    Format format;
+    int rows, cols;
+    QVector<int> cells;
+    QVector<int> remap; // tile id -> id in the file, empty to write ids as they are
+    QJsonObject map;    // all keys but "cells"
+
+    MapSnapshot(): format(TEXT), rows(0), cols(0) {}
+    static Format formatFor(QString const & filename);
+};
+
+QString writeMapSnapshot(MapSnapshot const & snapshot, QString const & filename);
+QByteArray unpackMapData(QByteArray const & data);
+
+#endif // MAPSAVE_H
@@ -1,240 +1,251 @@
 /*
  * \file mapwidget.cpp
  * \author Igor Bereznyak <igor.bereznyak@gmail.com>
- * \brief An implementation of the main MapEd widget.
+ * \brief An implementation of the map view widget.
  *
  * TODO features:
  *  - some strange bug with cursor highligh
  *	- sprites list: remove
  *  - refact selArea
- *  - static objects
  **/
 #include "mapwidget.h"
 
-#include <QMessageBox>
-#include <QJsonValue>
-#include <QJsonArray>
-#include <QJsonObject>
-#include <QJsonDocument>
-#include <QFile>
+#include <QGuiApplication>
+#include <QScreen>
 
-MapWidget::MapWidget(QWidget *parent) :
+#include <algorithm>
+
+#define GRAB_PREVIEW_MAX_SIDE 4096 // in pixels, larger selections are previewed downscaled
+
+MapWidget::MapWidget(MapDocument * document, QWidget *parent) :
     QWidget(parent),
-    mRows(0),
-    mCols(0),
+    mDoc(document),
     mEditMode(NORMAL),
-    mTileSize(-1, -1),
     mViewportPos(.0f, .0f),
     mCellUnderMouse(-1, -1),
     mSelectionBegin(NULL),
     mSelectionEnd(NULL),
-    mScale(1.0f)
+    mScale(1.0f),
+    mObjectSelecting(false),
+    mBrushTile(-1),
+    mBrushSize(1),
+    mStrokeActive(false),
+    mAnimate(false),
+    mAnimatedRunsValid(false),
+    mDirtyAll(false),
+    mInFrame(false),
+    mFrameIssued(false),
+    mFrameRequestedAt(0),
+    mFrameBudget(16)
 {
     setMouseTracking(true);
     setFocusPolicy(Qt::StrongFocus);
+
+    QScreen * screen = QGuiApplication::primaryScreen();
+    if (screen && screen->refreshRate() > 1.0)
+        mFrameBudget = qMax(1, int(1000.0 / screen->refreshRate()));
+    mLastFrameAt = -mFrameBudget;
+    mFrameClock.start();
+    mFrameTimer.setSingleShot(true);
+    connect(&mFrameTimer, SIGNAL(timeout()), this, SLOT(onFrame()));
+    mAnimationTimer.setSingleShot(true);
+    connect(&mAnimationTimer, SIGNAL(timeout()), this, SLOT(onAnimationTick()));
+
+    connect(mDoc, SIGNAL(aboutToReset()), this, SLOT(onAboutToReset()));
+    connect(mDoc, SIGNAL(cellsChanged(QRect)), this, SLOT(onCellsChanged(QRect)));
+    connect(mDoc, SIGNAL(objectsChanged(QRectF)), this, SLOT(onObjectsChanged(QRectF)));
+    connect(mDoc, SIGNAL(tilesChanged()), this, SLOT(onTilesChanged()));
+    connect(mDoc, SIGNAL(mapResized()), this, SLOT(onMapResized()));
+    connect(mDoc, SIGNAL(mapLoaded()), this, SLOT(onMapLoaded()));
+    connect(mDoc, SIGNAL(animationsChanged()), this, SLOT(onAnimationsChanged()));
 }
 
-void MapWidget::setMapSize(int rows, int cols)
+void MapWidget::onAboutToReset()
 {
-    if (rows == mRows && cols == mCols) return;
-
-    QVector<int> newCells(rows * cols);
-    newCells.fill(-1);
-    if (!mCells.isEmpty()) {
-        int i, j;
-        int mrow = qMin<int>(rows, mRows);
-        int mcol = qMin<int>(cols, mCols);
-        for(i = 0; i < mcol; ++i) {
-            for(j = 0; j < mrow; ++j)
-                newCells[i + j * cols] = mCells[i + j * mCols];
-        }
-    }
-    mCells = newCells;
-    mRows = rows;
-    mCols = cols;
-    update();
+    endStroke();
 }
 
-bool MapWidget::saveMap(QString const & filename) const
+void MapWidget::onCellsChanged(QRect const & cells)
 {
-    QJsonObject jsn_map;
-    QJsonObject jsn_tiles;
-    QJsonArray jsn_cells;
-
-    for(int i = 0; i < mTiles.size(); ++i) {
-        QString index = QString("%1").arg(i);
-        jsn_tiles.insert(index, QJsonValue(mTiles[i].fileName));
+    if ((mEditMode == GRAB || mEditMode == DUPLICATE) && cells.intersects(getSelectedArea(*mSelectionBegin, *mSelectionEnd)))
+        captureGrabPreview();
+    scheduleRepaint(cellsToWidget(cells));
+    if (mAnimate && mDoc->hasAnimations()) {
+        mAnimatedRunsValid = false;
+        if (!mAnimationTimer.isActive()) scheduleAnimationTick();
     }
+}
 
-    for(QVector<int>::const_iterator it = mCells.begin(); it != mCells.end(); ++it)
-        jsn_cells.push_back(QJsonValue(*it));
-
-    jsn_map.insert("rows", QJsonValue(mRows));
-    jsn_map.insert("cols", QJsonValue(mCols));
-    jsn_map.insert("tiles", jsn_tiles);
-    jsn_map.insert("cells", jsn_cells);
-
-    QJsonDocument jsn_doc(jsn_map);
-    QByteArray jsn_out = filename.endsWith("json") ? jsn_doc.toJson() : jsn_doc.toBinaryData();
-
-    QFile qf(filename);
-    if (!qf.open(QIODevice::WriteOnly | QIODevice::Truncate))
-        return false;
-
-    if (-1 == qf.write(jsn_out)) {
-        qf.close();
-        return false;
+void MapWidget::onObjectsChanged(QRectF const & area)
+{
+    // selected objects may have been removed by undo in any view
+    QSet<int>::iterator it = mSelectedObjects.begin();
+    while (it != mSelectedObjects.end()) {
+        if (mDoc->getObjects().object(*it).valid)
+            ++it;
+        else
+            it = mSelectedObjects.erase(it);
     }
-
-    qf.close();
-    return true;
+    scheduleRepaint(mapToWidget(area));
 }
 
-void MapWidget::loadMap(QString const & filename) {
-    // read file
-
-    QFile qf(filename);
-    if (!qf.open(QIODevice::ReadOnly)) throw qf.errorString();
-
-    QByteArray jsn_in = qf.readAll();
-    qf.close();
-    if (jsn_in.isEmpty()) throw QString("Empty file");
+void MapWidget::onTilesChanged()
+{
+    // tile ids may have been renumbered
+    mBrushTile = -1;
+    onAnimationsChanged();
+}
 
-    // parse file
+void MapWidget::onMapResized()
+{
+    if (mSelectionBegin) clipCellCoord(*mSelectionBegin);
+    if (mSelectionEnd) clipCellCoord(*mSelectionEnd);
+    onAnimationsChanged();
+}
 
-    QJsonDocument jsn_doc;
-    if (filename.endsWith("json")) {
-        jsn_doc = QJsonDocument::fromJson(jsn_in);
-    } else {
-        jsn_doc = QJsonDocument::fromBinaryData(jsn_in);
-    }
-    if (jsn_doc.isNull()) throw QString("Failed to validate JSON data");
-    if (!jsn_doc.isObject()) throw QString("Top level JSON value is not an object");
-    QJsonObject jsn_map = jsn_doc.object();
-
-    // load generic map info
-
-    QJsonObject::const_iterator it;
-    it = jsn_map.find("rows");
-    if (it == jsn_map.end()) throw QString("File not contains 'rows'");
-    if (!it.value().isDouble()) throw QString("'rows' is not a number");
-    int rows = int(it.value().toDouble());
-
-    it = jsn_map.find("cols");
-    if (it == jsn_map.end()) throw QString("File not contains 'cols'");
-    if (!it.value().isDouble()) throw QString("'cols' is not a number");
-    int cols = int(it.value().toDouble());
-
-    // load tiles FIXME: each key must be in [0; jsn_tiles.size()-1] or assertion happens
-
-    it = jsn_map.find("tiles");
-    if (it == jsn_map.end()) throw QString("File not contains 'tiles'");
-    if (!it.value().isObject()) throw QString("'cells' is not an object");
-    QJsonObject jsn_tiles = it.value().toObject();
-    QVector<MapTile> tiles(jsn_tiles.size());
-    QSize tileSize(-1, -1);
-    int prev_tile_id = -1;
-    for(QJsonObject::const_iterator i = jsn_tiles.begin(); i != jsn_tiles.end(); ++i) {
-        int tile_id = i.key().toInt();
-        if (tile_id - prev_tile_id != 1) throw QString("Non-monotonic tile keys");
-        if (!i.value().isString()) throw QString("Incorrect tile's path");
-        QImage im(i.value().toString());
-        if (im.isNull()) throw QString("Can't open image");
-        if (tileSize.isEmpty()) {
-            tileSize = im.size();
-        } else if (tileSize != im.size()) {
-            throw QString("Tile's dimensions not same");
-        }
-        tiles[tile_id] = MapTile(i.value().toString(), im);
-        prev_tile_id = tile_id;
-    }
-
-    // load cells
-
-    QVector<int> cells(cols * rows);
-    it = jsn_map.find("cells");
-    if (it == jsn_map.end()) throw QString("File not contains 'cells'");
-    if (!it.value().isArray()) throw QString("'cells' is not an array");
-    QJsonArray jsn_cells = it.value().toArray();
-    if (jsn_cells.size() != cols * rows) throw QString("Incorrect 'cells' length");
-    int index = -1;
-    for(QJsonArray::const_iterator i = jsn_cells.begin(); i != jsn_cells.end(); ++i) {
-        if (!(*i).isDouble()) throw QString("Not number in 'cells'");
-        int val = int((*i).toDouble());
-        if (val < -1 || val >= tiles.size()) throw QString("Incorrect range in 'cells'");
-        if (val > 0 && false == tiles[val].isValid()) throw QString("Incorrect link in 'cells'");
-        cells[++index] = val;
-    }
-
-    // if everything is fine
-    mCells = cells;
-    mTiles = tiles;
-    mRows = rows;
-    mCols = cols;
-    mTileSize = tileSize;
+void MapWidget::onMapLoaded()
+{
+    mEditMode = NORMAL;
+    mGrabPreview = QPixmap();
+    mBrushTile = -1;
+    mSelectedObjects.clear();
     mViewportPos = QPointF(.0f, .0f);
     mCellUnderMouse = QPoint(-1, -1);
+    delete mSelectionBegin;
+    delete mSelectionEnd;
     mSelectionBegin = NULL;
     mSelectionEnd = NULL;
     mScale = 1.0f;
+    onAnimationsChanged();
+}
 
-    update();
+void MapWidget::onAnimationsChanged()
+{
+    mAnimatedRunsValid = false;
+    mShownFrames.clear();
+    if (mAnimate) scheduleAnimationTick();
+    scheduleRepaint();
 }
 
-bool MapWidget::addTiles(QStringList const & files)
+/*!
+ * \brief Show animated tiles in motion. When off, animated tiles show their own image.
+ */
+void MapWidget::setAnimationPreview(bool on)
 {
-    QSize tileSize = mTileSize;
-    QVector<MapTile> tiles;
+    mAnimate = on;
+    if (!on) mAnimationTimer.stop();
+    onAnimationsChanged();
+}
 
-    QStringList list = files;
-    for (QStringList::Iterator it = list.begin(); it != list.end(); ++it) {
-        QImage im(*it);
+/*!
+ * \brief Visible cells, clipped by the map.
+ */
+QRect MapWidget::getVisibleCells() const
+{
+    QPoint beg = getCellUnderMouse(rect().topLeft());
+    QPoint end = getCellUnderMouse(rect().bottomRight());
+    clipCellCoord(beg);
+    clipCellCoord(end);
+    return QRect(beg, end);
+}
 
-        if (!im.isNull()) {
-            qDebug() << "Loading tile: " << *it << " / " << im.size();
-            if (tileSize.isEmpty()) {
-                tileSize = im.size();
-            } else if (tileSize != im.size()) {
-                QMessageBox msg;
-                msg.setInformativeText("Operation canceled due to errors");
-                QString s = QString("Tile in file %1 have dimensions %2x%3 while expected tile size is %4x%5").arg(*it).arg(im.size().width()).arg(im.size().height()).arg(tileSize.width()).arg(tileSize.height());
-                msg.setText(s);
-                msg.setIcon(QMessageBox::Critical);
-                msg.exec();
-                return false; // to do: maybe just throw an exception?
+/*!
+ * \brief Find runs of visible cells with animated tiles. Only chunks where
+ * the usage index has an animated tile are scanned.
+ */
+void MapWidget::collectAnimatedRuns()
+{
+    mAnimatedRuns.clear();
+    mAnimatedArea = getVisibleCells();
+    mAnimatedRunsValid = true;
+    if (mDoc->getRows() == 0 || mDoc->getCols() == 0) return;
+
+    TileUsage const & usage = mDoc->getTileUsage();
+    QHash<int, TileAnimation> const & animations = mDoc->getAnimations();
+    for(QHash<int, TileAnimation>::const_iterator it = animations.begin(); it != animations.end(); ++it) {
+        int tile = it.key();
+        if (it.value().frames.size() < 2 || !usage.cells(tile)) continue;
+        QVector<int> chunks = usage.chunksWith(tile);
+        for(QVector<int>::const_iterator c = chunks.begin(); c != chunks.end(); ++c) {
+            QRect area = usage.chunkArea(*c) & mAnimatedArea;
+            for(int j = area.top(); j <= area.bottom(); ++j) {
+                int run = -1;
+                for(int i = area.left(); i <= area.right() + 1; ++i) {
+                    bool animated = i <= area.right() && mDoc->cellAt(i, j) == tile;
+                    if (animated && run < 0) {
+                        run = i;
+                    } else if (!animated && run >= 0) {
+                        AnimatedRun r;
+                        r.cells = QRect(run, j, i - run, 1);
+                        r.tile = tile;
+                        mAnimatedRuns << r;
+                        run = -1;
+                    }
+                }
             }
-            tiles << MapTile(*it, im);
-        } else {
-            QMessageBox msg(QMessageBox::Warning, "Cannot read file", "Failed to read file " + *it);
-            msg.exec();
         }
     }
+}
+
+/*!
+ * \brief Start the animation timer for the nearest frame switch of an animated tile on the map.
+ * The timer is not started if no animated tile is used, so a static map costs nothing.
+ */
+void MapWidget::scheduleAnimationTick()
+{
+    qint64 now = mDoc->animationTime();
+    TileUsage const & usage = mDoc->getTileUsage();
+    QHash<int, TileAnimation> const & animations = mDoc->getAnimations();
+    int wait = -1;
+    for(QHash<int, TileAnimation>::const_iterator it = animations.begin(); it != animations.end(); ++it) {
+        if (!usage.cells(it.key())) continue;
+        int next = it.value().untilNextFrame(now);
+        if (next >= 0 && (wait < 0 || next < wait)) wait = next;
+    }
+    if (wait < 0)
+        mAnimationTimer.stop();
+    else
+        mAnimationTimer.start(qMax(wait, mFrameBudget));
+}
 
-    // If succeed
-    if (mTileSize.isEmpty())
-        mTileSize = tileSize;
-    mTiles += tiles;
+/*!
+ * \brief Repaint visible cells of the animated tiles whose frame has switched.
+ * Runs are scheduled one by one, so cells between them are not drawn (see paintEvent()).
+ */
+void MapWidget::onAnimationTick()
+{
+    if (!mAnimate) return;
+    if (!mAnimatedRunsValid || getVisibleCells() != mAnimatedArea)
+        collectAnimatedRuns();
+
+    qint64 now = mDoc->animationTime();
+    QSet<int> switched;
+    QHash<int, TileAnimation> const & animations = mDoc->getAnimations();
+    for(QHash<int, TileAnimation>::const_iterator it = animations.begin(); it != animations.end(); ++it) {
+        int frame = it.value().frameAt(now);
+        if (mShownFrames.value(it.key(), -1) != frame) {
+            mShownFrames.insert(it.key(), frame);
+            switched.insert(it.key());
+        }
+    }
 
-    return true;
+    for(QVector<AnimatedRun>::const_iterator it = mAnimatedRuns.begin(); it != mAnimatedRuns.end(); ++it) {
+        if (switched.contains(it->tile))
+            scheduleRepaint(cellsToWidget(it->cells));
+    }
+    scheduleAnimationTick();
 }
 
 void MapWidget::eraseSelected()
 {
     if (!mSelectionBegin || !mSelectionEnd) return;
 
-    int i, j;
-    QRect selArea = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
-    for(i = selArea.left(); i <= selArea.right(); ++i) {
-        for(j = selArea.top(); j <= selArea.bottom(); ++j) {
-            mCells[i + j * mCols] = -1;
-        } // for j
-    } // for i
-    update();
+    mDoc->fillCells(getSelectedArea(*mSelectionBegin, *mSelectionEnd), -1);
 }
 
 void MapWidget::selectAll() {
     QPoint b(0,0);
-    QPoint e(mCols - 1, mRows - 1);
+    QPoint e(mDoc->getCols() - 1, mDoc->getRows() - 1);
 
     if (mSelectionBegin && mSelectionEnd && *mSelectionBegin == b && *mSelectionEnd == e) {
         delete mSelectionBegin;
@@ -248,7 +259,7 @@ void MapWidget::selectAll() {
         mSelectionEnd = new QPoint(e);
         emit cellSelected();
     }
-    update();
+    scheduleRepaint();
 }
 
 QRect MapWidget::getSelectedTilesCount() const
@@ -264,7 +275,7 @@ int MapWidget::getSelectedTile() const
         QRect selArea = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
         for(i = selArea.left(); i <= selArea.right(); ++i) {
             for(j = selArea.top(); j <= selArea.bottom(); ++j) {
-                tile_id = mCells[i + j * mCols];
+                tile_id = mDoc->cellAt(i, j);
                 if (have_first) {
                     if (tile_id != common_tile_id)return -1;
                 } else {
@@ -297,7 +308,8 @@ void MapWidget::startModeGrab()
     QRect globalOrigin = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
     mGrabOrigin = mCellUnderMouse - globalOrigin.topLeft();
     mEditMode = GRAB;
-    update();
+    captureGrabPreview();
+    scheduleRepaint(cellsToWidget(getCursorArea(mCellUnderMouse)));
 }
 
 void MapWidget::startModeDuplicate()
@@ -315,64 +327,221 @@ void MapWidget::startModeDuplicate()
     QRect globalOrigin = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
     mGrabOrigin = mCellUnderMouse - globalOrigin.topLeft();
     mEditMode = DUPLICATE;
-    update();
+    captureGrabPreview();
+    scheduleRepaint(cellsToWidget(getCursorArea(mCellUnderMouse)));
+}
+
+/*!
+ * \brief Render the selected cells once into a pixmap, which is drawn at the grab offset while the mouse moves.
+ */
+void MapWidget::captureGrabPreview()
+{
+    QRect selArea = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
+    QSize tileSize = mDoc->getTileSize();
+    QSize full(selArea.width() * tileSize.width(), selArea.height() * tileSize.height());
+    if (full.isEmpty()) {
+        mGrabPreview = QPixmap();
+        return;
+    }
+
+    qreal k = qMin<qreal>(1.0, qreal(GRAB_PREVIEW_MAX_SIDE) / qMax(full.width(), full.height()));
+    mGrabPreview = QPixmap(qMax(1, qRound(full.width() * k)), qMax(1, qRound(full.height() * k)));
+    mGrabPreview.fill(Qt::transparent);
+
+    QPainter painter(&mGrabPreview);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, k < 1.0);
+    painter.scale(k, k);
+    int i, j, tile_indx;
+    mDoc->holdTilePixels(true);
+    for(j = selArea.top(); j <= selArea.bottom(); ++j) {
+        for(i = selArea.left(); i <= selArea.right(); ++i) {
+            tile_indx = mDoc->cellAt(i, j);
+            if (tile_indx >= 0)
+                mDoc->drawTile(painter, (i - selArea.left()) * tileSize.width(), (j - selArea.top()) * tileSize.height(), tile_indx);
+        }
+    }
+    mDoc->holdTilePixels(false);
 }
 
 void MapWidget::finishSpecialMode(bool confirm)
 {
+    // the document reports changed cells itself, so only the cursor is repainted here
+    QRect cursor = getCursorArea(mCellUnderMouse);
+
     switch (mEditMode) {
     case GRAB:
     case DUPLICATE:
-        if (confirm) {
-            int i, j, ind, src_offset, dst_offset;
-            ///! \todo Refact, this code is duplicated:
-            QRect selArea = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
-            QRect destArea(
-                mCellUnderMouse.x() - mGrabOrigin.x(),
-                mCellUnderMouse.y() - mGrabOrigin.y(),
-                selArea.width(),
-                selArea.height());
-            clipCellRect(destArea);
-            src_offset = selArea.left() + selArea.top() * mCols;
-            dst_offset = destArea.left() + destArea.top() * mCols;
-            for(i = destArea.width()-1; i >= 0 ; --i) {
-                for(j = destArea.height()-1; j >= 0; --j) {
-                    ind = i + j * mCols;
-                    mCells[dst_offset + ind] = mCells[src_offset + ind];
-                    if (mEditMode == GRAB) mCells[src_offset + ind] = -1;
-                }
+        {
+            // leave the mode first, so that the copy does not capture the preview again
+            bool move = mEditMode == GRAB;
+            mEditMode = NORMAL;
+            mGrabPreview = QPixmap();
+            if (confirm) {
+                QRect selArea = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
+                mDoc->copyCells(selArea, mCellUnderMouse - mGrabOrigin, move);
             }
         }
         break;
 
+    case PAINT:
+        endStroke();
+        break;
+
     default:
         break;
     }
 
     mEditMode = NORMAL;
-    update();
+    QRect after = getCursorArea(mCellUnderMouse);
+    if (cursor.isNull() || after.isNull()) {
+        scheduleRepaint();
+    } else {
+        scheduleRepaint(cellsToWidget(cursor));
+        scheduleRepaint(cellsToWidget(after));
+    }
 }
 
-void MapWidget::setSelectedTile(int tile)
+void MapWidget::toggleModePaint()
 {
-    if (mSelectionBegin && mSelectionEnd) {
-        int i, j;
-        QRect selArea = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
-        for(i = selArea.left(); i <= selArea.right(); ++i) {
-            for(j = selArea.top(); j <= selArea.bottom(); ++j) {
-                mCells[i + j * mCols] = tile;
+    if (mEditMode == PAINT) {
+        endStroke();
+        mEditMode = NORMAL;
+        emit miscellaneousNotification("Normal mode");
+    } else if (mEditMode == NORMAL) {
+        mEditMode = PAINT;
+        emit miscellaneousNotification("Brush mode");
+    } else {
+        emit miscellaneousNotification("Cannot paint from this mode");
+        return;
+    }
+    scheduleRepaint();
+}
+
+QRect MapWidget::getBrushArea(QPoint const & center) const
+{
+    int half = (mBrushSize - 1) / 2;
+    return QRect(center.x() - half, center.y() - half, mBrushSize, mBrushSize);
+}
+
+/*!
+ * \brief Queue brush centers on the line from the previous stroke cell to cell.
+ *
+ * Mouse events may skip many cells during a fast stroke, so every cell in between is rasterized.
+ */
+void MapWidget::queueStrokeTo(QPoint const & cell)
+{
+    int x = mStrokeLast.x(), y = mStrokeLast.y();
+    int dx = qAbs(cell.x() - x), sx = x < cell.x() ? 1 : -1;
+    int dy = -qAbs(cell.y() - y), sy = y < cell.y() ? 1 : -1;
+    int err = dx + dy, e2;
+    while (x != cell.x() || y != cell.y()) {
+        e2 = 2 * err;
+        if (e2 >= dy) { err += dy; x += sx; }
+        if (e2 <= dx) { err += dx; y += sy; }
+        mStrokePending << QPoint(x, y);
+    }
+    mStrokeLast = cell;
+    requestFrame();
+}
+
+/*!
+ * \brief Apply all brush centers queued since the last frame and repaint their bounding region once.
+ */
+void MapWidget::flushStroke()
+{
+    if (mStrokePending.isEmpty()) return;
+
+    int i, j, ind;
+    int cols = mDoc->getCols();
+    QRect bounds(0, 0, cols, mDoc->getRows());
+    QSet<int> queued;
+    QVector<int> indices, values;
+    QRect painted;
+    for(QVector<QPoint>::const_iterator it = mStrokePending.begin(); it != mStrokePending.end(); ++it) {
+        QRect area = getBrushArea(*it) & bounds;
+        for(i = area.left(); i <= area.right(); ++i) {
+            for(j = area.top(); j <= area.bottom(); ++j) {
+                ind = i + j * cols;
+                if (!mDoc->isSameTerrain(mDoc->cellAt(i, j), mBrushTile) && !queued.contains(ind)) {
+                    if (!mStrokeBefore.contains(ind))
+                        mStrokeBefore.insert(ind, mDoc->cellAt(i, j));
+                    queued.insert(ind);
+                    indices << ind;
+                    values << mBrushTile;
+                    painted |= QRect(i, j, 1, 1);
+                }
             } // for j
         } // for i
-        update();
-    } // if (selected)
+    }
+    mStrokePending.clear();
+
+    mDoc->applyCells(indices, values);
+    // neighbours changed by auto-tiling belong to the stroke too, so that undo restores them
+    if (mDoc->isAutoTiling() && !painted.isEmpty())
+        mDoc->autoTile(painted, &mStrokeBefore);
+}
+
+/*!
+ * \brief Finish the current brush stroke and record it as a single undo step.
+ */
+void MapWidget::endStroke()
+{
+    if (!mStrokeActive) return;
+
+    flushStroke();
+    mStrokeActive = false;
+    mDoc->pushCellsChange("Paint", mStrokeBefore);
+    mStrokeBefore.clear();
 }
 
-void MapWidget::insertInto(QComboBox * tiles) {
-    for(int i = 0; i < mTiles.size(); ++i) {
-        tiles->addItem(QIcon(QPixmap::fromImage(mTiles[i].im)), mTiles[i].fileName);
+/*!
+ * \brief Place a static object with the brush tile under the mouse cursor.
+ */
+void MapWidget::addObjectAtMouse()
+{
+    if (!mDoc->getTileSize().isValid() || mBrushTile < 0 || mBrushTile >= mDoc->getTilesCount()) {
+        emit miscellaneousNotification("Choose a tile for the object first");
+        return;
+    }
+
+    QPointF pos = localToGlobal(mMousePos) / mScale;
+    mDoc->addObject(MapObject(mBrushTile, pos));
+    emit miscellaneousNotification(QString("Objects: %1").arg(mDoc->getObjects().count()));
+}
+
+void MapWidget::eraseSelectedObjects()
+{
+    QSet<int> ids = mSelectedObjects;
+    mSelectedObjects.clear();
+    mDoc->removeObjects(ids);
+}
+
+/*!
+ * \brief Select objects overlapping area, or the topmost object at a point if area is (almost) empty.
+ * \param area Rectangle in map pixels.
+ */
+void MapWidget::selectObjects(QRectF const & area)
+{
+    mSelectedObjects.clear();
+    if (area.width() * mScale < 3 && area.height() * mScale < 3) {
+        int id = mDoc->getObjects().pick(area.center());
+        if (id >= 0) mSelectedObjects.insert(id);
+    } else {
+        QVector<int> found = mDoc->getObjects().query(area);
+        for(QVector<int>::const_iterator it = found.begin(); it != found.end(); ++it)
+            mSelectedObjects.insert(*it);
     }
+    emit miscellaneousNotification(QString("Selected %1 objects").arg(mSelectedObjects.size()));
+    scheduleRepaint();
+}
+
+void MapWidget::setSelectedTile(int tile)
+{
+    if (mSelectionBegin && mSelectionEnd)
+        mDoc->fillCells(getSelectedArea(*mSelectionBegin, *mSelectionEnd), tile);
 }
 
+
 QPointF MapWidget::localToGlobal(QPointF const & local) const
 {
     return local - (mViewportPos + mDragOffset);
@@ -382,20 +551,27 @@ QPoint MapWidget::getCellUnderMouse(QPointF const & mouse) const
 {
     QPointF global = localToGlobal(mouse);
     return QPoint(
-        floor(global.x() / (((float)mTileSize.width()) * mScale)),
-        floor(global.y() / (((float)mTileSize.height()) * mScale)));
+        floor(global.x() / (((float)mDoc->getTileSize().width()) * mScale)),
+        floor(global.y() / (((float)mDoc->getTileSize().height()) * mScale)));
 }
 
 void MapWidget::keyPressEvent(QKeyEvent * event) {
     if (event->key() == Qt::Key_X && event->modifiers() == Qt::NoModifier) {
-        eraseSelected();
-        update();
+        if (mSelectedObjects.isEmpty())
+            eraseSelected();
+        else
+            eraseSelectedObjects();
+        scheduleRepaint();
+    } else if (event->key() == Qt::Key_A && event->modifiers() == Qt::ShiftModifier) {
+        addObjectAtMouse();
     } else if (event->key() == Qt::Key_A && event->modifiers() == Qt::NoModifier) {
         selectAll();
     } else if (event->key() == Qt::Key_G && event->modifiers() == Qt::NoModifier) {
         startModeGrab();
     } else if (event->key() == Qt::Key_D && event->modifiers() == Qt::ShiftModifier) {
         startModeDuplicate();
+    } else if (event->key() == Qt::Key_B && event->modifiers() == Qt::NoModifier) {
+        toggleModePaint();
     } else if (event->key() == Qt::Key_Escape && event->modifiers() == Qt::NoModifier) {
         finishSpecialMode(false);
     } else if (event->key() == Qt::Key_Enter && event->modifiers() == Qt::ShiftModifier) {
@@ -408,21 +584,44 @@ void MapWidget::mouseMoveEvent(QMouseEvent * event)
 {
     if (event->buttons() & Qt::MidButton) {
         mDragOffset = event->localPos() - mDragOrigin;
-        update();
+        scheduleRepaint();
+    }
+    mMousePos = event->localPos();
+
+    if (mObjectSelecting) {
+        mObjectSelectEnd = localToGlobal(mMousePos) / mScale;
+        scheduleRepaint();
     }
 
     QPoint cell = getCellUnderMouse(event->localPos());
+    if (mStrokeActive && (event->buttons() & Qt::LeftButton) && cell != mStrokeLast)
+        queueStrokeTo(cell);
+
     if (cell != mCellUnderMouse) {
+        QRect before = getCursorArea(mCellUnderMouse);
+        QRect after = getCursorArea(cell);
         mCellUnderMouse = cell;
-        update();
+        if (before.isNull() || after.isNull()) {
+            scheduleRepaint();
+        } else {
+            scheduleRepaint(cellsToWidget(before));
+            scheduleRepaint(cellsToWidget(after));
+        }
     }
-
 }
 
 void MapWidget::mousePressEvent(QMouseEvent *event)
 {
     if (event->button() == Qt::MidButton) {
         mDragOrigin = event->localPos();
+    } else if (event->button() == Qt::LeftButton && mEditMode == PAINT && mDoc->getTileSize().isValid()) {
+        mStrokeActive = true;
+        mStrokeLast = getCellUnderMouse(event->localPos());
+        mStrokePending << mStrokeLast;
+        requestFrame();
+    } else if (event->button() == Qt::RightButton && (event->modifiers() & Qt::ControlModifier)) {
+        mObjectSelecting = true;
+        mObjectSelectOrigin = mObjectSelectEnd = localToGlobal(event->localPos()) / mScale;
     } else if (event->button() == Qt::RightButton) {
         if (mSelectionBegin) delete mSelectionBegin;
         mSelectionBegin = new QPoint;
@@ -446,7 +645,15 @@ void MapWidget::mouseReleaseEvent(QMouseEvent *event)
 
     case Qt::RightButton:
     {
-        finishSpecialMode(false);
+        if (mObjectSelecting) {
+            mObjectSelecting = false;
+            mObjectSelectEnd = localToGlobal(event->localPos()) / mScale;
+            selectObjects(QRectF(mObjectSelectOrigin, mObjectSelectEnd).normalized());
+            break;
+        }
+
+        if (mEditMode != PAINT)
+            finishSpecialMode(false);
         QPoint tmp = getCellUnderMouse(event->localPos());
 
         if (mSelectionEnd) {
@@ -466,13 +673,16 @@ void MapWidget::mouseReleaseEvent(QMouseEvent *event)
                 clipCellCoord(*mSelectionEnd);
                 emit cellSelected();
             }
-            update();
+            scheduleRepaint();
         }
         break;
     }
 
     case Qt::LeftButton:
-        finishSpecialMode(true);
+        if (mEditMode == PAINT)
+            endStroke();
+        else
+            finishSpecialMode(true);
         break;
 
     default:
@@ -483,31 +693,137 @@ void MapWidget::mouseReleaseEvent(QMouseEvent *event)
 void MapWidget::wheelEvent(QWheelEvent * event)
 {
     if (event->angleDelta().y() > 0) mScale /= 1.1; else mScale *= 1.1;
-    update();
+    scheduleRepaint();
 }
 
 void MapWidget::clipCellCoord(QPoint & c) const {
     if (c.x() <= 0) {
         c.setX(0);
-    } else if (c.x() >= mCols) {
-        c.setX(mCols - 1);
+    } else if (c.x() >= mDoc->getCols()) {
+        c.setX(mDoc->getCols() - 1);
     }
 
     if (c.y() <= 0) {
         c.setY(0);
-    } else if (c.y() >= mRows) {
-        c.setY(mRows - 1);
+    } else if (c.y() >= mDoc->getRows()) {
+        c.setY(mDoc->getRows() - 1);
+    }
+}
+
+/*!
+ * \brief Cells covered by the cursor highlight, or a null rectangle if the highlight depends on more than the cell.
+ */
+QRect MapWidget::getCursorArea(QPoint const & cell) const
+{
+    switch (mEditMode) {
+    case NORMAL:
+        if (mSelectionBegin && !mSelectionEnd) return QRect();
+        return QRect(cell, QSize(1, 1));
+    case PAINT:
+        return getBrushArea(cell);
+    case GRAB:
+    case DUPLICATE:
+        return QRect(cell - mGrabOrigin, getSelectedArea(*mSelectionBegin, *mSelectionEnd).size());
+    default:
+        return QRect();
+    }
+}
+
+/*!
+ * \brief Repaint the whole widget with the next frame.
+ */
+void MapWidget::scheduleRepaint()
+{
+    mDirtyAll = true;
+    requestFrame();
+}
+
+/*!
+ * \brief Repaint a part of the widget with the next frame.
+ * \param r Rectangle in widget coordinates.
+ */
+void MapWidget::scheduleRepaint(QRect const & r)
+{
+    if (!mDirtyAll)
+        mDirtyRegion += r;
+    requestFrame();
+}
+
+/*!
+ * \brief Start the frame timer so that the next frame comes no earlier than one frame budget after the previous one.
+ */
+void MapWidget::requestFrame()
+{
+    if (mInFrame) return;
+    if (mFrameTimer.isActive()) {
+        ++mFrameStats.coalesced;
+        return;
+    }
+    mFrameRequestedAt = mFrameClock.elapsed();
+    qint64 wait = mFrameBudget - (mFrameRequestedAt - mLastFrameAt);
+    mFrameTimer.start(int(qBound<qint64>(0, wait, mFrameBudget)));
+}
+
+void MapWidget::onFrame()
+{
+    mInFrame = true;
+    flushStroke();
+    mInFrame = false;
+
+    if (mDirtyAll) {
+        update();
+    } else if (!mDirtyRegion.isEmpty()) {
+        update(mDirtyRegion);
+    } else {
+        return;
     }
+    mDirtyAll = false;
+    mDirtyRegion = QRegion();
+    mFrameIssued = true;
+    ++mFrameStats.frames;
+}
+
+/*!
+ * \brief Map a rectangle of cells to widget coordinates, e.g. for a partial repaint.
+ */
+QRect MapWidget::cellsToWidget(QRect const & cells) const
+{
+    return mapToWidget(QRectF(
+        cells.left() * mDoc->getTileSize().width(),
+        cells.top() * mDoc->getTileSize().height(),
+        cells.width() * mDoc->getTileSize().width(),
+        cells.height() * mDoc->getTileSize().height()));
+}
+
+/*!
+ * \brief Cells under a rectangle in widget coordinates, clipped by the map.
+ */
+QRect MapWidget::widgetToCells(QRect const & r) const
+{
+    QPoint beg = getCellUnderMouse(r.topLeft());
+    clipCellCoord(beg);
+    QPoint end = getCellUnderMouse(r.bottomRight());
+    clipCellCoord(end);
+    return QRect(beg, end);
 }
 
-void MapWidget::clipCellRect(QRect & r) const
+/*!
+ * \brief Map a rectangle in map pixels to widget coordinates.
+ */
+QRect MapWidget::mapToWidget(QRectF const & r) const
 {
-    QPoint topLeft = r.topLeft();
-    QPoint bottomRight = r.bottomRight();
-    clipCellCoord(topLeft);
-    clipCellCoord(bottomRight);
-    r.setTopLeft(topLeft);
-    r.setBottomRight(bottomRight);
+    QPointF vpTopLeft = mViewportPos + mDragOffset;
+    QRectF w(vpTopLeft.x() + r.left() * mScale, vpTopLeft.y() + r.top() * mScale, r.width() * mScale, r.height() * mScale);
+    return w.toAlignedRect().adjusted(-1, -1, 1, 1);
+}
+
+/*!
+ * \brief Map a rectangle in widget coordinates to map pixels.
+ */
+QRectF MapWidget::widgetToMap(QRect const & r) const
+{
+    QPointF topLeft = localToGlobal(r.topLeft());
+    return QRectF(topLeft / mScale, QSizeF(r.width() / mScale, r.height() / mScale));
 }
 
 /*!
@@ -523,32 +839,43 @@ QRect MapWidget::getSelectedArea(QPoint const & fst, QPoint const & snd) const
     frame.setLeft(qMin<int>(fst.x(), snd.x()));
     if (frame.left() <= 0)
         frame.setLeft(0);
-    else if (frame.left() >= mCols)
-        frame.setLeft(mCols - 1);
+    else if (frame.left() >= mDoc->getCols())
+        frame.setLeft(mDoc->getCols() - 1);
 
     frame.setTop(qMin<int>(fst.y(), snd.y()));
     if (frame.top() <= 0)
         frame.setTop(0);
-    else if (frame.top() >= mRows)
-        frame.setTop(mRows - 1);
+    else if (frame.top() >= mDoc->getRows())
+        frame.setTop(mDoc->getRows() - 1);
 
     frame.setRight(frame.left() + qAbs(fst.x() - snd.x()));
     if (frame.right() <= 0)
         frame.setRight(0);
-    else if (frame.right() >= mCols)
-        frame.setRight(mCols - 1);
+    else if (frame.right() >= mDoc->getCols())
+        frame.setRight(mDoc->getCols() - 1);
 
     frame.setBottom(frame.top() + qAbs(fst.y() - snd.y()));
     if (frame.bottom() <= 0)
         frame.setBottom(0);
-    else if (frame.bottom() >= mRows)
-        frame.setBottom(mRows - 1);
+    else if (frame.bottom() >= mDoc->getRows())
+        frame.setBottom(mDoc->getRows() - 1);
 
     return frame;
 }
 
-void MapWidget::paintEvent(QPaintEvent *)
+void MapWidget::paintEvent(QPaintEvent * event)
 {
+    qint64 now = mFrameClock.elapsed();
+    if (mFrameIssued) {
+        qint64 latency = now - mFrameRequestedAt;
+        if (latency > mFrameBudget * 3 / 2) {
+            ++mFrameStats.late;
+            mFrameStats.dropped += int(latency / mFrameBudget) - 1;
+        }
+        mFrameIssued = false;
+    }
+    mLastFrameAt = now;
+
     QPainter painter(this);
     QRectF rectf(0, 0, width(), height());
     QPointF vpTopLeft = mViewportPos + mDragOffset;
@@ -561,54 +888,95 @@ void MapWidget::paintEvent(QPaintEvent *)
     painter.translate(vpTopLeft);
     painter.scale(mScale, mScale);
 
-    if (mTileSize.isValid()) {
+    if (mDoc->getTileSize().isValid()) {
         int i, j, tile_indx;
-        QPoint visAreaBeg = getCellUnderMouse(QPoint(0,0)); // TODO: this is just viewport coords / width-height!
-        clipCellCoord(visAreaBeg);
-        QPoint visAreaEnd = getCellUnderMouse(visAreaBeg + QPoint(this->width(), this->height()));
-        clipCellCoord(visAreaEnd);
-
-        for(i = visAreaBeg.x(); i <= visAreaEnd.x(); ++i) {
-            for(j = visAreaBeg.y(); j <= visAreaEnd.y(); ++j) {
-                tile_indx = mCells.at(i + j * mCols);
-                if (tile_indx >= 0)
-                    painter.drawImage(i * mTileSize.width(), j * mTileSize.height(), mTiles[tile_indx].im);
+        QRect dirty = event->rect();
+
+        // only cells inside of the repainted region, which may be many small rectangles far apart;
+        // a cell shared by two rectangles is drawn once, so that translucent tiles are not blended twice
+        QRegion cells;
+        QVector<QRect> rects = event->region().rects();
+        for(QVector<QRect>::const_iterator r = rects.begin(); r != rects.end(); ++r)
+            cells += widgetToCells(*r);
+
+        bool animate = mAnimate && mDoc->hasAnimations();
+        qint64 animTime = mDoc->animationTime();
+        mDoc->holdTilePixels(true); // sheets of evicted tiles are decoded once per frame
+        QVector<QRect> runs = cells.rects();
+        for(QVector<QRect>::const_iterator r = runs.begin(); r != runs.end(); ++r) {
+            for(j = r->top(); j <= r->bottom(); ++j) {
+                for(i = r->left(); i <= r->right(); ++i) {
+                    tile_indx = mDoc->cellAt(i, j);
+                    if (animate && tile_indx >= 0)
+                        tile_indx = mDoc->animationFrame(tile_indx, animTime);
+                    if (tile_indx >= 0)
+                        mDoc->drawTile(painter, i * mDoc->getTileSize().width(), j * mDoc->getTileSize().height(), tile_indx);
+                }
             }
         }
 
+        // static objects overlapping the repainted region, each one once and in the order of ids
+        QRectF area = widgetToMap(dirty);
+        QSet<int> found;
+        for(QVector<QRect>::const_iterator r = rects.begin(); r != rects.end(); ++r) {
+            QVector<int> ids = mDoc->getObjects().query(widgetToMap(*r));
+            for(QVector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+                found.insert(*it);
+        }
+        QVector<int> objects = found.toList().toVector();
+        std::sort(objects.begin(), objects.end());
+        for(QVector<int>::const_iterator it = objects.begin(); it != objects.end(); ++it) {
+            MapObject const & o = mDoc->getObjects().object(*it);
+            mDoc->drawTile(painter, qRound(o.pos.x()), qRound(o.pos.y()), o.tile);
+        }
+        mDoc->holdTilePixels(false);
+
         // highlight cursor
         switch (mEditMode) {
         case NORMAL:
             if (mSelectionBegin && !mSelectionEnd) {
                 QRect frame = getSelectedArea(*mSelectionBegin, mCellUnderMouse);
                 painter.fillRect(
-                    frame.left() * mTileSize.width(),
-                    frame.top() * mTileSize.height(),
-                    frame.width() * mTileSize.width(),
-                    frame.height() * mTileSize.height(),
+                    frame.left() * mDoc->getTileSize().width(),
+                    frame.top() * mDoc->getTileSize().height(),
+                    frame.width() * mDoc->getTileSize().width(),
+                    frame.height() * mDoc->getTileSize().height(),
                     QColor(127, 127, 255, 50));
             } else if (isValidCell(mCellUnderMouse)) {
-                int x = mCellUnderMouse.x() * mTileSize.width();
-                int y = mCellUnderMouse.y() * mTileSize.height();
-                painter.fillRect(x, y, mTileSize.width(), mTileSize.height(), QColor(127, 127, 255, 50));
+                int x = mCellUnderMouse.x() * mDoc->getTileSize().width();
+                int y = mCellUnderMouse.y() * mDoc->getTileSize().height();
+                painter.fillRect(x, y, mDoc->getTileSize().width(), mDoc->getTileSize().height(), QColor(127, 127, 255, 50));
             }
             break;
 
         case GRAB:
         case DUPLICATE:
             {
-                QRect selArea = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
-                QRect frame(
-                    mCellUnderMouse.x() - mGrabOrigin.x(),
-                    mCellUnderMouse.y() - mGrabOrigin.y(),
-                    selArea.width(),
-                    selArea.height());
+                QRect frame = getCursorArea(mCellUnderMouse);
+                QRectF target(
+                    frame.left() * mDoc->getTileSize().width(),
+                    frame.top() * mDoc->getTileSize().height(),
+                    frame.width() * mDoc->getTileSize().width(),
+                    frame.height() * mDoc->getTileSize().height());
+                if (!mGrabPreview.isNull()) {
+                    painter.save();
+                    painter.setOpacity(0.8);
+                    painter.drawPixmap(target, mGrabPreview, QRectF(mGrabPreview.rect()));
+                    painter.restore();
+                }
+                painter.fillRect(target, QColor(127, 127, 255, 50));
+            }
+            break;
+
+        case PAINT:
+            if (isValidCell(mCellUnderMouse)) {
+                QRect frame = getBrushArea(mCellUnderMouse) & QRect(0, 0, mDoc->getCols(), mDoc->getRows());
                 painter.fillRect(
-                    frame.left() * mTileSize.width(),
-                    frame.top() * mTileSize.height(),
-                    frame.width() * mTileSize.width(),
-                    frame.height() * mTileSize.height(),
-                    QColor(127, 127, 255, 50));
+                    frame.left() * mDoc->getTileSize().width(),
+                    frame.top() * mDoc->getTileSize().height(),
+                    frame.width() * mDoc->getTileSize().width(),
+                    frame.height() * mDoc->getTileSize().height(),
+                    QColor(255, 127, 127, 50));
             }
             break;
         }
@@ -617,15 +985,29 @@ void MapWidget::paintEvent(QPaintEvent *)
         if (mSelectionBegin && mSelectionEnd) {
             QRect frame = getSelectedArea(*mSelectionBegin, *mSelectionEnd);
             painter.fillRect(
-                frame.left() * mTileSize.width(),
-                frame.top() * mTileSize.height(),
-                frame.width() * mTileSize.width(),
-                frame.height() * mTileSize.height(),
+                frame.left() * mDoc->getTileSize().width(),
+                frame.top() * mDoc->getTileSize().height(),
+                frame.width() * mDoc->getTileSize().width(),
+                frame.height() * mDoc->getTileSize().height(),
                 QColor(0, 255, 0, 75));
         }
 
+        // highlight selected objects
+        if (!mSelectedObjects.isEmpty() || mObjectSelecting) {
+            painter.save();
+            painter.setPen(Qt::yellow);
+            painter.setBrush(Qt::NoBrush);
+            for(QSet<int>::const_iterator it = mSelectedObjects.begin(); it != mSelectedObjects.end(); ++it) {
+                QRectF b = mDoc->getObjects().bounds(*it);
+                if (b.intersects(area)) painter.drawRect(b);
+            }
+            if (mObjectSelecting)
+                painter.fillRect(QRectF(mObjectSelectOrigin, mObjectSelectEnd).normalized(), QColor(255, 255, 0, 50));
+            painter.restore();
+        }
+
         painter.setPen(Qt::red);
-        painter.drawRect(-1, -1, mCols * mTileSize.width(), mRows * mTileSize.height());
+        painter.drawRect(-1, -1, mDoc->getCols() * mDoc->getTileSize().width(), mDoc->getRows() * mDoc->getTileSize().height());
     } else {
         painter.setPen(Qt::red);
         painter.drawLine(-10, 0, 10, 0);
@@ -1,7 +1,7 @@
 /*
  * \file mapwidget.h
  * \author Igor Bereznyak <igor.bereznyak@gmail.com>
- * \brief A header of the main MapEd widget.
+ * \brief A header of the map view widget.
  **/
 #ifndef MAPWIDGET_H
 #define MAPWIDGET_H
@@ -9,29 +9,49 @@
 #include <QWidget>
 #include <QtGui>
 #include <QVector>
-#include <QComboBox>
+#include <QHash>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QRegion>
+#include <QSet>
+#include "mapdocument.h"
 
+/*!
+ * \brief A view of a map document. Views of the same document share its data,
+ * each one keeps only its own viewport, selection and edit mode.
+ */
 class MapWidget : public QWidget
 {
     Q_OBJECT
 public:
-    explicit MapWidget(QWidget *parent = 0);
-    void setMapSize(int rows, int cols);
-    inline void setScale(float s) { mScale = s; update(); }
-    bool addTiles(QStringList const & files);
-    void insertInto(QComboBox * tiles);
+    explicit MapWidget(MapDocument * document, QWidget *parent = 0);
+    inline MapDocument * document() const { return mDoc; }
+    inline void setScale(float s) { mScale = s; scheduleRepaint(); }
     int getSelectedTile() const;
     void setSelectedTile(int tile);
-    bool saveMap(QString const & filename) const;
-    void loadMap(QString const & filename);
-    inline int getRows() const { return mRows; }
-    inline int getCols() const { return mCols; }
     void eraseSelected();
     void selectAll();
     QRect getSelectedTilesCount() const;
     void startModeGrab();
     void startModeDuplicate();
     void finishSpecialMode(bool confirm);
+    void toggleModePaint();
+    void addObjectAtMouse();
+    void eraseSelectedObjects();
+    inline void setBrushTile(int tile) { mBrushTile = tile; }
+    inline void setBrushSize(int size) { mBrushSize = qMax(1, size); scheduleRepaint(); }
+    void setAnimationPreview(bool on);
+
+    struct FrameStats {
+        int frames;     // repaints issued by the scheduler
+        int coalesced;  // changes merged into an already pending frame
+        int late;       // frames painted later than 1.5 frame budgets after their first change
+        int dropped;    // display frames missed because of late frames
+        FrameStats(): frames(0), coalesced(0), late(0), dropped(0) {}
+    };
+    inline FrameStats const & getFrameStats() const { return mFrameStats; }
+    void scheduleRepaint();
+    void scheduleRepaint(QRect const & r);
 
 protected:
     void paintEvent(QPaintEvent * event);
@@ -42,10 +62,24 @@ protected:
     void keyPressEvent(QKeyEvent * event);
     inline QPointF localToGlobal(QPointF const & local) const;
     inline QPoint getCellUnderMouse(QPointF const & mouse) const;
-    inline bool isValidCell(QPoint const & cell) const { return cell.x() >= 0 && cell.y() >= 0 && cell.x() < mCols && cell.y() < mRows; }
+    inline bool isValidCell(QPoint const & cell) const { return cell.x() >= 0 && cell.y() >= 0 && cell.x() < mDoc->getCols() && cell.y() < mDoc->getRows(); }
     inline void clipCellCoord(QPoint & c) const;
-    inline void clipCellRect(QRect & r) const;
     QRect getSelectedArea(QPoint const & fst, QPoint const & snd) const;
+    QRect cellsToWidget(QRect const & cells) const;
+    QRect widgetToCells(QRect const & r) const;
+    QRect mapToWidget(QRectF const & r) const;
+    QRectF widgetToMap(QRect const & r) const;
+    void selectObjects(QRectF const & area);
+    inline QRect getBrushArea(QPoint const & center) const;
+    QRect getCursorArea(QPoint const & cell) const;
+    void requestFrame();
+    void flushStroke();
+    void queueStrokeTo(QPoint const & cell);
+    void endStroke();
+    void captureGrabPreview();
+    QRect getVisibleCells() const;
+    void collectAnimatedRuns();
+    void scheduleAnimationTick();
 
 signals:
     void cellSelected();
@@ -54,30 +88,65 @@ signals:
 
 public slots:
 
+private slots:
+    void onFrame();
+    void onAboutToReset();
+    void onCellsChanged(QRect const & cells);
+    void onObjectsChanged(QRectF const & area);
+    void onTilesChanged();
+    void onMapResized();
+    void onMapLoaded();
+    void onAnimationsChanged();
+    void onAnimationTick();
+
 private:
-    int mRows, mCols;
-    QVector<int> mCells;
+    MapDocument * mDoc;
 
-    enum EditMode { NORMAL, GRAB, DUPLICATE };
+    enum EditMode { NORMAL, GRAB, DUPLICATE, PAINT };
     EditMode mEditMode;
 
-    QSize mTileSize;
-    struct MapTile {
-        QImage im;
-        QString fileName;
-        bool valid;
-        MapTile(): valid(false) {}
-        MapTile(QString const & fname, QImage const & i): im(i), fileName(fname), valid(true) {}
-        inline bool isValid() const { return valid; }
-    };
-    QVector<MapTile> mTiles;
     QPointF mViewportPos;
     QPointF mDragOffset;
     QPointF mDragOrigin;
     QPoint mCellUnderMouse;
     QPoint * mSelectionBegin, * mSelectionEnd;
     QPoint mGrabOrigin;
+    QPixmap mGrabPreview; // selected cells while grabbing or duplicating
     float mScale;
+    QPointF mMousePos;
+
+    QSet<int> mSelectedObjects;
+    bool mObjectSelecting;
+    QPointF mObjectSelectOrigin, mObjectSelectEnd; // in map pixels
+
+    int mBrushTile, mBrushSize;
+    bool mStrokeActive;
+    QPoint mStrokeLast;
+    QVector<QPoint> mStrokePending; // brush centers not yet applied
+    QHash<int, int> mStrokeBefore;  // cell index -> tile id before the stroke
+
+    // animation preview: only visible cells with animated tiles are repainted, when their frame switches
+    struct AnimatedRun {
+        QRect cells; // a part of a row
+        int tile;
+    };
+    bool mAnimate;
+    QTimer mAnimationTimer;
+    QVector<AnimatedRun> mAnimatedRuns;
+    QRect mAnimatedArea; // visible cells when the runs were collected
+    bool mAnimatedRunsValid;
+    QHash<int, int> mShownFrames; // animated tile -> frame index painted last
+
+    // render scheduler: changes are accumulated and painted at most once per display frame
+    QTimer mFrameTimer;
+    QElapsedTimer mFrameClock;
+    QRegion mDirtyRegion;
+    bool mDirtyAll;
+    bool mInFrame;
+    bool mFrameIssued;
+    qint64 mFrameRequestedAt, mLastFrameAt;
+    int mFrameBudget; // in ms
+    FrameStats mFrameStats;
 };
 
 #endif // MAPWIDGET_H
@@ -0,0 +1,165 @@
+/*
+ * \file objectlayer.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of the static objects layer.
+ **/
+#include "objectlayer.h"
+
+#include <algorithm>
+
+ObjectLayer::ObjectLayer(int bucketSize) :
+    mBucketSize(qMax(1, bucketSize)),
+    mItemSize(1, 1),
+    mCount(0)
+{
+}
+
+int ObjectLayer::add(MapObject const & obj)
+{
+    // ids are not reused, so a new object is always drawn on top
+    int id = mObjects.size();
+    mObjects << obj;
+    mObjects[id].valid = true;
+    mBuckets[bucketOf(obj.pos)] << id;
+    ++mCount;
+    return id;
+}
+
+void ObjectLayer::remove(int id)
+{
+    if (id < 0 || id >= mObjects.size() || !mObjects[id].valid) return;
+
+    QHash<BucketKey, QVector<int> >::iterator b = mBuckets.find(bucketOf(mObjects[id].pos));
+    if (b != mBuckets.end()) {
+        int at = b.value().indexOf(id);
+        if (at >= 0) b.value().remove(at);
+        if (b.value().isEmpty()) mBuckets.erase(b);
+    }
+    mObjects[id] = MapObject();
+    --mCount;
+}
+
+/*!
+ * \brief Bring a removed object back under its old id, e.g. for undo, so that it keeps its drawing order.
+ */
+void ObjectLayer::restore(int id, MapObject const & obj)
+{
+    if (id < 0 || id >= mObjects.size() || mObjects[id].valid) return;
+
+    mObjects[id] = obj;
+    mObjects[id].valid = true;
+    mBuckets[bucketOf(obj.pos)] << id;
+    ++mCount;
+}
+
+void ObjectLayer::move(int id, QPointF const & pos)
+{
+    if (id < 0 || id >= mObjects.size() || !mObjects[id].valid) return;
+
+    BucketKey from = bucketOf(mObjects[id].pos);
+    BucketKey to = bucketOf(pos);
+    if (from != to) {
+        QVector<int> & bucket = mBuckets[from];
+        int at = bucket.indexOf(id);
+        if (at >= 0) bucket.remove(at);
+        if (bucket.isEmpty()) mBuckets.remove(from);
+        mBuckets[to] << id;
+    }
+    mObjects[id].pos = pos;
+}
+
+/*!
+ * \brief Change tile ids of objects, e.g. after tiles were merged; objects whose tile maps to -1 are removed.
+ */
+void ObjectLayer::remapTiles(QVector<int> const & remap)
+{
+    for(int id = 0; id < mObjects.size(); ++id) {
+        if (!mObjects[id].valid) continue;
+        int tile = mObjects[id].tile;
+        int to = (tile >= 0 && tile < remap.size()) ? remap[tile] : -1;
+        if (to < 0)
+            remove(id);
+        else
+            mObjects[id].tile = to;
+    }
+}
+
+void ObjectLayer::clear()
+{
+    mObjects.clear();
+    mBuckets.clear();
+    mCount = 0;
+}
+
+/*!
+ * \brief Find objects which overlap area.
+ * \return Ids in ascending order, which is also the drawing order.
+ */
+QVector<int> ObjectLayer::query(QRectF const & area) const
+{
+    QVector<int> found;
+    if (!mCount || area.isEmpty()) return found;
+
+    // objects starting up to one object size before the area still overlap it
+    int bx0 = bucketOf(area.left() - mItemSize.width());
+    int by0 = bucketOf(area.top() - mItemSize.height());
+    int bx1 = bucketOf(area.right());
+    int by1 = bucketOf(area.bottom());
+
+    if (qint64(bx1 - bx0 + 1) * (by1 - by0 + 1) <= mBuckets.size()) {
+        for(int by = by0; by <= by1; ++by) {
+            for(int bx = bx0; bx <= bx1; ++bx) {
+                QHash<BucketKey, QVector<int> >::const_iterator b = mBuckets.find(bucketKey(bx, by));
+                if (b == mBuckets.end()) continue;
+                for(QVector<int>::const_iterator it = b.value().begin(); it != b.value().end(); ++it) {
+                    if (bounds(*it).intersects(area)) found << *it;
+                }
+            }
+        }
+    } else {
+        // the area covers more buckets than there are, e.g. when zoomed out
+        for(QHash<BucketKey, QVector<int> >::const_iterator b = mBuckets.begin(); b != mBuckets.end(); ++b) {
+            for(QVector<int>::const_iterator it = b.value().begin(); it != b.value().end(); ++it) {
+                if (bounds(*it).intersects(area)) found << *it;
+            }
+        }
+    }
+
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+/*!
+ * \brief Topmost (last drawn) object at point, -1 if there is none.
+ */
+int ObjectLayer::pick(QPointF const & point) const
+{
+    int best = -1;
+    int bx0 = bucketOf(point.x() - mItemSize.width());
+    int by0 = bucketOf(point.y() - mItemSize.height());
+    int bx1 = bucketOf(point.x());
+    int by1 = bucketOf(point.y());
+    for(int by = by0; by <= by1; ++by) {
+        for(int bx = bx0; bx <= bx1; ++bx) {
+            QHash<BucketKey, QVector<int> >::const_iterator b = mBuckets.find(bucketKey(bx, by));
+            if (b == mBuckets.end()) continue;
+            for(QVector<int>::const_iterator it = b.value().begin(); it != b.value().end(); ++it) {
+                if (*it > best && bounds(*it).contains(point)) best = *it;
+            }
+        }
+    }
+    return best;
+}
+
+/*!
+ * \brief All objects in drawing order.
+ */
+QVector<int> ObjectLayer::ids() const
+{
+    QVector<int> all;
+    all.reserve(mCount);
+    for(int id = 0; id < mObjects.size(); ++id) {
+        if (mObjects[id].valid) all << id;
+    }
+    return all;
+}
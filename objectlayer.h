@@ -0,0 +1,69 @@
+/*
+ * \file objectlayer.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief A layer of free-positioned static objects (trees, props, spawn points).
+ **/
+#ifndef OBJECTLAYER_H
+#define OBJECTLAYER_H
+
+#include <QHash>
+#include <QPointF>
+#include <QRectF>
+#include <QSizeF>
+#include <QString>
+#include <QVector>
+#include <qmath.h>
+
+struct MapObject {
+    int tile;       // sprite, an id in the tile table
+    QPointF pos;    // top-left corner in map pixels
+    QString type;   // free-form, e.g. "tree" or "spawn"
+    bool valid;
+    MapObject(): tile(-1), valid(false) {}
+    MapObject(int t, QPointF const & p, QString const & ty = QString()): tile(t), pos(p), type(ty), valid(true) {}
+};
+
+/*!
+ * \brief Objects in a grid of square buckets, so that culling and picking visit only nearby objects.
+ *
+ * All objects have the same size (the tile size). An object is stored in the bucket
+ * of its top-left corner, queries widen the area by one object size to catch objects
+ * which start in a neighbouring bucket. Object ids are stable until clear() and
+ * define the drawing order.
+ */
+class ObjectLayer
+{
+public:
+    explicit ObjectLayer(int bucketSize = 256);
+
+    inline int bucketSize() const { return mBucketSize; }
+    inline int count() const { return mCount; }
+    inline MapObject const & object(int id) const { return mObjects[id]; }
+    inline QRectF bounds(int id) const { return QRectF(mObjects[id].pos, mItemSize); }
+    void setItemSize(QSizeF const & size) { mItemSize = size; }
+
+    int add(MapObject const & obj);
+    void remove(int id);
+    void restore(int id, MapObject const & obj);
+    void move(int id, QPointF const & pos);
+    void remapTiles(QVector<int> const & remap);
+    void clear();
+
+    QVector<int> query(QRectF const & area) const;
+    int pick(QPointF const & point) const;
+    QVector<int> ids() const;
+
+private:
+    typedef quint64 BucketKey;
+    inline BucketKey bucketKey(int bx, int by) const { return (BucketKey(quint32(bx)) << 32) | quint32(by); }
+    inline int bucketOf(qreal v) const { return int(qFloor(v / mBucketSize)); }
+    inline BucketKey bucketOf(QPointF const & p) const { return bucketKey(bucketOf(p.x()), bucketOf(p.y())); }
+
+    int mBucketSize;
+    QSizeF mItemSize;
+    QVector<MapObject> mObjects;
+    QHash<BucketKey, QVector<int> > mBuckets;
+    int mCount;
+};
+
+#endif // OBJECTLAYER_H
@@ -0,0 +1,233 @@
+/*
+ * \file maprt.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief A header-only reader of maps exported by MapEd for game runtimes.
+ *
+ * The file is a packed little-endian image which is used in place after mmap(),
+ * so opening a map costs a header check and looking up a cell is a single load:
+ *
+ *     Header
+ *     int32_t   cells[rows * cols]       row-major, -1 is an empty cell
+ *     TileRect  tiles[tileCount]         rectangle of every tile in its image
+ *     ImageRef  images[imageCount]       sprite sheets and standalone tile files
+ *     uint32_t  chunks[chunkRows * chunkCols]  non-empty cells per chunk (optional)
+ *     char      strings[]                zero-terminated UTF-8 image paths
+ *
+ * Every section starts at a multiple of MAPRT_ALIGNMENT.
+ *
+ * Usage:
+ *     maprt::Map map;
+ *     if (map.open("level.mapr")) {
+ *         int32_t tile = map.cell(row, col);
+ *         const maprt::TileRect * r = map.tile(tile);
+ *         const char * image = map.imagePath(r->image);
+ *     }
+ **/
+#ifndef MAPRT_H
+#define MAPRT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MAPRT_VERSION 1
+#define MAPRT_ALIGNMENT 16
+#define MAPRT_BYTE_ORDER_MARK 0x01020304u
+
+namespace maprt {
+
+struct Header {
+    char magic[4];          // "MAPR"
+    uint32_t byteOrder;     // MAPRT_BYTE_ORDER_MARK as written by the exporter
+    uint32_t version;
+    uint32_t rows, cols;
+    uint32_t tileWidth, tileHeight;
+    uint32_t tileCount;
+    uint32_t imageCount;
+    uint32_t chunkSize;     // side of a chunk in cells, 0 if there is no chunk index
+    uint64_t cellsOffset;
+    uint64_t tilesOffset;
+    uint64_t imagesOffset;
+    uint64_t chunksOffset;
+    uint64_t stringsOffset;
+    uint64_t fileSize;
+};
+
+struct TileRect {
+    uint32_t image;         // index in images
+    uint32_t x, y, w, h;    // in pixels
+};
+
+struct ImageRef {
+    uint32_t path;          // offset in strings
+    uint32_t length;        // in bytes, without terminating zero
+};
+
+inline uint64_t alignUp(uint64_t offset) {
+    return (offset + MAPRT_ALIGNMENT - 1) & ~uint64_t(MAPRT_ALIGNMENT - 1);
+}
+
+inline uint32_t chunksAlong(uint32_t cells, uint32_t chunkSize) {
+    return chunkSize ? (cells + chunkSize - 1) / chunkSize : 0;
+}
+
+/*!
+ * \brief Read-only view of an exported map. Does not allocate and does not parse anything.
+ */
+class Map
+{
+public:
+    Map(): mData(NULL), mSize(0), mMapped(false), mHeader(NULL), mCells(NULL), mTiles(NULL), mImages(NULL), mChunks(NULL), mStrings(NULL) {}
+    ~Map() { close(); }
+
+    /*!
+     * \brief Map the file into memory and validate its layout.
+     * \return false if the file cannot be mapped or is not a valid map.
+     */
+    bool open(const char * filename) {
+        close();
+#if defined(_WIN32)
+        (void)filename;
+        return false;
+#else
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void * p = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        mData = static_cast<const char *>(p);
+        mSize = size_t(st.st_size);
+        mMapped = true;
+        if (!validate()) {
+            close();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    /*!
+     * \brief Use a map which is already in memory (embedded resource, archive, etc).
+     * \param data Must be aligned to 8 bytes and stay valid while the map is used.
+     */
+    bool attach(const void * data, size_t size) {
+        close();
+        mData = static_cast<const char *>(data);
+        mSize = size;
+        if (!validate()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#if !defined(_WIN32)
+        if (mMapped && mData)
+            munmap(const_cast<char *>(mData), mSize);
+#endif
+        mData = NULL;
+        mSize = 0;
+        mMapped = false;
+        mHeader = NULL;
+        mCells = NULL;
+        mTiles = NULL;
+        mImages = NULL;
+        mChunks = NULL;
+        mStrings = NULL;
+    }
+
+    inline bool isOpen() const { return mHeader != NULL; }
+    inline uint32_t rows() const { return mHeader->rows; }
+    inline uint32_t cols() const { return mHeader->cols; }
+    inline uint32_t tileWidth() const { return mHeader->tileWidth; }
+    inline uint32_t tileHeight() const { return mHeader->tileHeight; }
+    inline uint32_t tileCount() const { return mHeader->tileCount; }
+    inline uint32_t imageCount() const { return mHeader->imageCount; }
+
+    /*! \brief Tile id of a cell, -1 for empty cells. Coordinates are not checked. */
+    inline int32_t cell(uint32_t row, uint32_t col) const { return mCells[size_t(row) * mHeader->cols + col]; }
+    inline int32_t cellAt(uint32_t row, uint32_t col) const { return (row < mHeader->rows && col < mHeader->cols) ? cell(row, col) : -1; }
+    inline const int32_t * cells() const { return mCells; }
+
+    /*! \brief Rectangle of a tile in its image, NULL for the empty tile id. */
+    inline const TileRect * tile(int32_t id) const { return (id >= 0 && uint32_t(id) < mHeader->tileCount) ? mTiles + id : NULL; }
+    inline const char * imagePath(uint32_t image) const { return mStrings + mImages[image].path; }
+
+    inline bool hasChunks() const { return mChunks != NULL; }
+    inline uint32_t chunkSize() const { return mHeader->chunkSize; }
+    inline uint32_t chunkRows() const { return chunksAlong(mHeader->rows, mHeader->chunkSize); }
+    inline uint32_t chunkCols() const { return chunksAlong(mHeader->cols, mHeader->chunkSize); }
+    /*! \brief Number of non-empty cells in a chunk, lets the runtime skip empty areas. */
+    inline uint32_t chunkFill(uint32_t chunkRow, uint32_t chunkCol) const { return mChunks[size_t(chunkRow) * chunkCols() + chunkCol]; }
+
+private:
+    Map(Map const &);
+    Map & operator=(Map const &);
+
+    bool section(uint64_t offset, uint64_t bytes) const {
+        return offset % MAPRT_ALIGNMENT == 0 && offset <= mSize && bytes <= mSize - offset;
+    }
+
+    bool validate() {
+        if (!mData || mSize < sizeof(Header)) return false;
+        const Header * h = reinterpret_cast<const Header *>(mData);
+        if (memcmp(h->magic, "MAPR", 4) != 0) return false;
+        if (h->byteOrder != MAPRT_BYTE_ORDER_MARK) return false;
+        if (h->version != MAPRT_VERSION) return false;
+        if (h->fileSize != mSize) return false;
+
+        uint64_t cells = uint64_t(h->rows) * h->cols;
+        uint64_t chunks = uint64_t(chunksAlong(h->rows, h->chunkSize)) * chunksAlong(h->cols, h->chunkSize);
+        if (!section(h->cellsOffset, cells * sizeof(int32_t))) return false;
+        if (!section(h->tilesOffset, uint64_t(h->tileCount) * sizeof(TileRect))) return false;
+        if (!section(h->imagesOffset, uint64_t(h->imageCount) * sizeof(ImageRef))) return false;
+        if (h->chunkSize && !section(h->chunksOffset, chunks * sizeof(uint32_t))) return false;
+        if (!section(h->stringsOffset, 0)) return false;
+
+        const TileRect * tiles = reinterpret_cast<const TileRect *>(mData + h->tilesOffset);
+        for(uint32_t i = 0; i < h->tileCount; ++i)
+            if (tiles[i].image >= h->imageCount) return false;
+
+        const ImageRef * images = reinterpret_cast<const ImageRef *>(mData + h->imagesOffset);
+        uint64_t strings = mSize - h->stringsOffset;
+        for(uint32_t i = 0; i < h->imageCount; ++i) {
+            if (uint64_t(images[i].path) + images[i].length >= strings) return false;
+            if (mData[h->stringsOffset + images[i].path + images[i].length] != '\0') return false;
+        }
+
+        mHeader = h;
+        mCells = reinterpret_cast<const int32_t *>(mData + h->cellsOffset);
+        mTiles = tiles;
+        mImages = images;
+        mChunks = h->chunkSize ? reinterpret_cast<const uint32_t *>(mData + h->chunksOffset) : NULL;
+        mStrings = mData + h->stringsOffset;
+        return true;
+    }
+
+    const char * mData;
+    size_t mSize;
+    bool mMapped;
+    const Header * mHeader;
+    const int32_t * mCells;
+    const TileRect * mTiles;
+    const ImageRef * mImages;
+    const uint32_t * mChunks;
+    const char * mStrings;
+};
+
+} // namespace maprt
+
+#endif // MAPRT_H
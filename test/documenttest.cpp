@@ -0,0 +1,98 @@
+/*
+ * \file documenttest.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Checks of MapDocument on maps built from generated tile files.
+ *
+ * Usage: QT_QPA_PLATFORM=offscreen documenttest
+ *
+ * Exit code is 0 if all checks pass, 1 otherwise.
+ **/
+#include "mapdocument.h"
+
+#include <QApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QTemporaryDir>
+#include <QTextStream>
+
+static int failures = 0;
+
+static void check(bool ok, QString const & what, QTextStream & out)
+{
+    out << (ok ? "ok   " : "FAIL ") << what << "\n";
+    if (!ok) ++failures;
+}
+
+static QString makeTile(QTemporaryDir const & dir, QString const & name, QColor const & color)
+{
+    QImage im(8, 8, QImage::Format_ARGB32);
+    im.fill(color);
+    QString fname = dir.path() + "/" + name;
+    im.save(fname);
+    return fname;
+}
+
+/*!
+ * \brief Water variants are named by the auto-tiling rules but not placed on the map,
+ * they must stay in the tile table through a purge and a save and reload,
+ * while a tile used by nothing is removed.
+ */
+static void testRuleVariantsSurvive(QTextStream & out)
+{
+    QTemporaryDir dir;
+    QString grass = makeTile(dir, "grass.png", Qt::green);
+    QString water0 = makeTile(dir, "water0.png", Qt::blue);
+    QString water15 = makeTile(dir, "water15.png", Qt::darkBlue);
+    QString tree = makeTile(dir, "tree.png", Qt::darkGreen);
+
+    QJsonObject jsn_tiles;
+    jsn_tiles.insert("0", QJsonValue(water0));
+    jsn_tiles.insert("15", QJsonValue(water15));
+    QJsonObject jsn_set;
+    jsn_set.insert("name", QJsonValue(QString("water")));
+    jsn_set.insert("tiles", jsn_tiles);
+    QJsonArray jsn_sets;
+    jsn_sets.push_back(jsn_set);
+    QJsonObject jsn_rules;
+    jsn_rules.insert("sets", jsn_sets);
+    QString rules = dir.path() + "/rules.json";
+    QFile qf(rules);
+    qf.open(QIODevice::WriteOnly);
+    qf.write(QJsonDocument(jsn_rules).toJson());
+    qf.close();
+
+    MapDocument doc;
+    doc.setMapSize(4, 4);
+    doc.addTiles(QStringList() << grass << water0 << water15 << tree);
+    doc.loadAutoTileRules(rules);
+    doc.fillCells(QRect(0, 0, 4, 4), 0);
+
+    check(doc.purgeUnusedTiles() == 1, "purge removes the tile used by nothing", out);
+    check(doc.getTilesCount() == 3, "purge keeps rule variants which are not on the map", out);
+
+    QString map = dir.path() + "/map.json";
+    check(writeMapSnapshot(doc.snapshot(map), map).isEmpty(), "map is saved", out);
+
+    MapDocument loaded;
+    try {
+        loaded.loadMap(map);
+    } catch (QString & error) {
+        check(false, "map is loaded: " + error, out);
+        return;
+    }
+    check(loaded.getTilesCount() == 3, "rule variants survive a save and reload", out);
+    check(loaded.hasAutoTileRules(), "rules survive a save and reload", out);
+    check(loaded.purgeUnusedTiles() == 0, "purge of the reloaded map keeps rule variants", out);
+}
+
+int main(int argc, char *argv[])
+{
+    QApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    testRuleVariantsSurvive(out);
+
+    out << (failures ? QString("%1 checks failed\n").arg(failures) : QString("all checks passed\n"));
+    return failures ? 1 : 0;
+}
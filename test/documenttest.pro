@@ -0,0 +1,31 @@
+#-------------------------------------------------
+#
+# Checks of the map document without the editor window
+#
+#-------------------------------------------------
+
+QT       += core gui widgets concurrent
+
+TARGET = documenttest
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += documenttest.cpp \
+    ../mapdocument.cpp \
+    ../tilecache.cpp \
+    ../objectlayer.cpp \
+    ../tileusage.cpp \
+    ../autotile.cpp \
+    ../mapsave.cpp
+
+HEADERS  += \
+    ../mapdocument.h \
+    ../tilecache.h \
+    ../objectlayer.h \
+    ../tileusage.h \
+    ../autotile.h \
+    ../mapsave.h \
+    ../runtime/maprt.h
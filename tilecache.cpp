@@ -0,0 +1,141 @@
+/*
+ * \file tilecache.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of the tile pixels cache.
+ **/
+#include "tilecache.h"
+
+TileCache::TileCache(int budgetMB) :
+    mHolding(false),
+    mPackedBytes(0)
+{
+    setBudget(budgetMB);
+}
+
+void TileCache::setBudget(int megabytes)
+{
+    mPixels.setMaxCost(qMax(1, megabytes) * 1024);
+}
+
+/*!
+ * \brief Add an image.
+ * \param key Identity of the image contents.
+ * \param image Already decoded pixels, they are cached if the budget allows. Pass a null image
+ * for a source of parts, which is not cached itself.
+ * \param packed Encoded image to decode from after eviction.
+ */
+void TileCache::insert(QByteArray const & key, QImage const & image, QByteArray const & packed)
+{
+    Entry & e = mEntries[key];
+    if (e.packed.isEmpty()) {
+        e.packed = packed;
+        mPackedBytes += packed.size();
+    }
+    if (!image.isNull())
+        e.size = image.size();
+    if (!image.isNull() && !mPixels.contains(key))
+        mPixels.insert(key, new QImage(image), cost(image));
+}
+
+/*!
+ * \brief Add a part of another image, e.g. a tile of a sprite sheet. Nothing is decoded until image() is called.
+ * \param key Identity of the part's contents, an image with the same pixels is shared.
+ * \param source Key of the image the part is cut from.
+ * \param rect Part of the source.
+ */
+void TileCache::insertPart(QByteArray const & key, QByteArray const & source, QRect const & rect)
+{
+    Entry & e = mEntries[key];
+    if (e.source.isEmpty()) {
+        e.source = source;
+        e.rect = rect;
+        e.size = rect.size();
+    }
+}
+
+/*!
+ * \brief Get decoded pixels, decoding them again if they were evicted.
+ *
+ * The returned image shares pixels with the cache and keeps them alive after eviction,
+ * so it is safe to draw from it while other images are decoded.
+ */
+QImage TileCache::image(QByteArray const & key)
+{
+    QImage * cached = mPixels.object(key);
+    if (cached) {
+        ++mStats.hits;
+        return *cached;
+    }
+
+    ++mStats.misses;
+    QHash<QByteArray, Entry>::const_iterator it = mEntries.find(key);
+    if (it == mEntries.end()) return QImage();
+    QImage im = !it.value().packed.isEmpty()
+        ? decode(it.value().packed)
+        : sourceImage(it.value().source).copy(it.value().rect);
+    if (!im.isNull())
+        mPixels.insert(key, new QImage(im), cost(im));
+    return im;
+}
+
+/*!
+ * \brief Keep decoded sources of parts until holdSources(false), e.g. for a paint pass,
+ * so that a sheet is decoded once rather than once per evicted tile.
+ */
+void TileCache::holdSources(bool hold)
+{
+    mHolding = hold;
+    if (!hold) mHeldSources.clear();
+}
+
+QImage TileCache::sourceImage(QByteArray const & key)
+{
+    QHash<QByteArray, QImage>::const_iterator held = mHeldSources.find(key);
+    if (held != mHeldSources.end()) return held.value();
+
+    QImage im = decode(mEntries.value(key).packed);
+    if (mHolding && !im.isNull())
+        mHeldSources.insert(key, im);
+    return im;
+}
+
+/*!
+ * \brief Forget images which are not in keys anymore.
+ */
+void TileCache::retain(QSet<QByteArray> const & keys)
+{
+    QHash<QByteArray, Entry>::iterator it = mEntries.begin();
+    while (it != mEntries.end()) {
+        // a part whose source is gone may still have pixels of its own
+        if (!it.value().source.isEmpty() && !keys.contains(it.value().source))
+            it.value().source.clear();
+        if (keys.contains(it.key()) && (!it.value().packed.isEmpty() || !it.value().source.isEmpty())) {
+            ++it;
+        } else {
+            mPixels.remove(it.key());
+            mHeldSources.remove(it.key());
+            mPackedBytes -= it.value().packed.size();
+            it = mEntries.erase(it);
+        }
+    }
+}
+
+void TileCache::clear()
+{
+    mPixels.clear();
+    mEntries.clear();
+    mHeldSources.clear();
+    mPackedBytes = 0;
+}
+
+QImage TileCache::decode(QByteArray const & packed)
+{
+    QImage im = QImage::fromData(packed);
+    if (im.isNull()) return im;
+    return im.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
+
+int TileCache::cost(QImage const & image)
+{
+    return qMax(1, image.byteCount() / 1024);
+}
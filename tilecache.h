@@ -0,0 +1,75 @@
+/*
+ * \file tilecache.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief A memory budget for decoded tile pixels.
+ **/
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QHash>
+#include <QImage>
+#include <QRect>
+#include <QSet>
+
+/*!
+ * \brief Decoded tile images under a memory budget.
+ *
+ * Every image is kept in its encoded form (the bytes of its file, usually PNG),
+ * decoded pixels are held in an LRU cache and evicted when the budget is exceeded.
+ * An evicted image is decoded again transparently by image().
+ *
+ * A part of another image (a tile of a sprite sheet) is cached on its own, so a
+ * sheet is evicted tile by tile. The whole source is decoded only to restore an
+ * evicted part; holdSources() keeps it decoded for a series of such misses.
+ */
+class TileCache
+{
+public:
+    struct Stats {
+        qint64 hits;    // image() found decoded pixels
+        qint64 misses;  // image() had to decode
+        Stats(): hits(0), misses(0) {}
+    };
+
+    explicit TileCache(int budgetMB = 1024);
+
+    void setBudget(int megabytes);
+    inline int budget() const { return mPixels.maxCost() / 1024; }
+    inline qint64 residentBytes() const { return qint64(mPixels.totalCost()) * 1024; }
+    inline qint64 packedBytes() const { return mPackedBytes; }
+    inline int count() const { return mEntries.size(); }
+    inline Stats const & stats() const { return mStats; }
+
+    inline bool contains(QByteArray const & key) const { return mEntries.contains(key); }
+    inline QSize size(QByteArray const & key) const { return mEntries.value(key).size; }
+    void insert(QByteArray const & key, QImage const & image, QByteArray const & packed);
+    void insertPart(QByteArray const & key, QByteArray const & source, QRect const & rect);
+    QImage image(QByteArray const & key);
+    void holdSources(bool hold);
+    void retain(QSet<QByteArray> const & keys);
+    void clear();
+
+    static QImage decode(QByteArray const & packed);
+
+private:
+    struct Entry {
+        QByteArray packed; // encoded image, empty for a part
+        QByteArray source; // key of the image a part is cut from
+        QRect rect;        // of the part in its source
+        QSize size;        // of the image, known without decoding
+    };
+
+    static int cost(QImage const & image);
+    QImage sourceImage(QByteArray const & key);
+
+    QCache<QByteArray, QImage> mPixels; // cost in KB
+    QHash<QByteArray, Entry> mEntries;
+    QHash<QByteArray, QImage> mHeldSources; // decoded sources while held, not counted by the budget
+    bool mHolding;
+    qint64 mPackedBytes;
+    Stats mStats;
+};
+
+#endif // TILECACHE_H
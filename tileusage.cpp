@@ -0,0 +1,120 @@
+/*
+ * \file tileusage.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An implementation of the tile usage index.
+ **/
+#include "tileusage.h"
+
+TileUsage::TileUsage(int chunkSize) :
+    mChunkSize(qMax(1, chunkSize)),
+    mRows(0),
+    mCols(0),
+    mChunkCols(0),
+    mChunkRows(0)
+{
+}
+
+/*!
+ * \brief Rebuild the index from scratch, e.g. after a map was loaded or resized.
+ * Counts of static objects are dropped as well.
+ */
+void TileUsage::reset(QVector<int> const & cells, int rows, int cols, int tiles)
+{
+    mRows = rows;
+    mCols = cols;
+    mChunkCols = (cols + mChunkSize - 1) / mChunkSize;
+    mChunkRows = (rows + mChunkSize - 1) / mChunkSize;
+    int chunks = mChunkCols * mChunkRows;
+
+    mCounts = QVector<int>(tiles, 0);
+    mObjectCounts = QVector<int>(tiles, 0);
+    mChunkTiles = QVector<QHash<int, int> >(chunks);
+    mPresence = QVector<QBitArray>(tiles, QBitArray(chunks));
+
+    for(int j = 0; j < rows; ++j) {
+        int const * row = cells.constData() + j * cols;
+        for(int i = 0; i < cols; ++i) {
+            if (row[i] >= 0)
+                increment(i / mChunkSize + j / mChunkSize * mChunkCols, row[i], 1);
+        }
+    }
+}
+
+/*!
+ * \brief Make room for new tiles, which are not used yet.
+ */
+void TileUsage::setTilesCount(int tiles)
+{
+    int chunks = mChunkCols * mChunkRows;
+    mCounts.resize(tiles);
+    mObjectCounts.resize(tiles);
+    mPresence.resize(tiles);
+    for(int t = 0; t < tiles; ++t) {
+        if (mPresence[t].size() != chunks)
+            mPresence[t] = QBitArray(chunks);
+    }
+}
+
+QVector<int> TileUsage::chunksWith(int tile) const
+{
+    QVector<int> chunks;
+    if (!mCounts[tile]) return chunks;
+
+    QBitArray const & bits = mPresence[tile];
+    for(int c = 0; c < bits.size(); ++c) {
+        if (bits.testBit(c)) chunks << c;
+    }
+    return chunks;
+}
+
+/*!
+ * \brief Cells of a chunk, clipped by the map.
+ */
+QRect TileUsage::chunkArea(int chunk) const
+{
+    QRect r((chunk % mChunkCols) * mChunkSize, (chunk / mChunkCols) * mChunkSize, mChunkSize, mChunkSize);
+    return r & QRect(0, 0, mCols, mRows);
+}
+
+/*!
+ * \brief Account a change of one cell.
+ * \param index Row-major index of the cell.
+ */
+void TileUsage::change(int index, int before, int after)
+{
+    if (before == after) return;
+    int chunk = chunkOf(index);
+    if (before >= 0) decrement(chunk, before, 1);
+    if (after >= 0) increment(chunk, after, 1);
+}
+
+/*!
+ * \brief Account a replacement of a tile by another one in some cells of a chunk.
+ */
+void TileUsage::replaceInChunk(int chunk, int before, int after, int cells)
+{
+    if (before == after || cells <= 0) return;
+    if (before >= 0) decrement(chunk, before, cells);
+    if (after >= 0) increment(chunk, after, cells);
+}
+
+void TileUsage::increment(int chunk, int tile, int cells)
+{
+    mCounts[tile] += cells;
+    int & n = mChunkTiles[chunk][tile];
+    if (!n) mPresence[tile].setBit(chunk);
+    n += cells;
+}
+
+void TileUsage::decrement(int chunk, int tile, int cells)
+{
+    mCounts[tile] -= cells;
+    QHash<int, int> & tiles = mChunkTiles[chunk];
+    QHash<int, int>::iterator it = tiles.find(tile);
+    if (it == tiles.end()) return;
+    it.value() -= cells;
+    if (it.value() <= 0) {
+        tiles.erase(it);
+        mPresence[tile].clearBit(chunk);
+    }
+}
@@ -0,0 +1,60 @@
+/*
+ * \file tileusage.h
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief An incremental index of tile usage: how many cells use a tile and in which chunks.
+ **/
+#ifndef TILEUSAGE_H
+#define TILEUSAGE_H
+
+#include <QBitArray>
+#include <QHash>
+#include <QRect>
+#include <QVector>
+
+#define TILEUSAGE_CHUNK_SIZE 32
+
+/*!
+ * \brief Usage counts of tiles, kept up to date by every change of a cell.
+ *
+ * The map is split into square chunks; each chunk counts its tiles and every tile
+ * has a bit per chunk which is set while the chunk contains the tile. So usage of
+ * a tile is known without scanning cells, and a search for a tile visits only the
+ * chunks where it is present. References from static objects are counted apart.
+ */
+class TileUsage
+{
+public:
+    explicit TileUsage(int chunkSize = TILEUSAGE_CHUNK_SIZE);
+
+    void reset(QVector<int> const & cells, int rows, int cols, int tiles);
+    void setTilesCount(int tiles);
+
+    inline int chunkSize() const { return mChunkSize; }
+    inline int tilesCount() const { return mCounts.size(); }
+    inline int cells(int tile) const { return mCounts[tile]; }
+    inline int objects(int tile) const { return mObjectCounts[tile]; }
+    inline bool isUsed(int tile) const { return mCounts[tile] || mObjectCounts[tile]; }
+    inline bool isInChunk(int tile, int chunk) const { return mPresence[tile].testBit(chunk); }
+    QVector<int> chunksWith(int tile) const;
+    QRect chunkArea(int chunk) const;
+
+    void change(int index, int before, int after);
+    void replaceInChunk(int chunk, int before, int after, int cells);
+    inline void addObject(int tile) { if (tile >= 0) ++mObjectCounts[tile]; }
+    inline void removeObject(int tile) { if (tile >= 0) --mObjectCounts[tile]; }
+
+private:
+    inline int chunkOf(int index) const { return (index % mCols) / mChunkSize + (index / mCols) / mChunkSize * mChunkCols; }
+    void increment(int chunk, int tile, int cells);
+    void decrement(int chunk, int tile, int cells);
+
+    int mChunkSize;
+    int mRows, mCols;
+    int mChunkCols, mChunkRows;
+    QVector<int> mCounts;                  // tile -> cells
+    QVector<int> mObjectCounts;            // tile -> static objects
+    QVector<QHash<int, int> > mChunkTiles; // chunk -> tile -> cells
+    QVector<QBitArray> mPresence;          // tile -> chunks where it is used
+};
+
+#endif // TILEUSAGE_H
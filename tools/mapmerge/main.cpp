@@ -0,0 +1,110 @@
+/*
+ * \file main.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Command line diff and merge of maps, usable as a git merge driver.
+ *
+ * Usage:
+ *     mapmerge diff <a> <b>
+ *     mapmerge merge <base> <ours> <theirs> [<output>]
+ *
+ * merge writes into ours when no output is given, as git expects from %A.
+ * Exit code is 0 for identical maps or a clean merge, 1 for differences or
+ * conflicts and 2 for errors.
+ **/
+#include "mapdiff.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTextStream>
+
+static QString tileName(TileTable const & table, int id)
+{
+    return id < 0 ? QString("<empty>") : QString("%1 (%2)").arg(id).arg(table.key(id));
+}
+
+static int runDiff(QString const & fa, QString const & fb, QTextStream & out)
+{
+    MapFile a, b;
+    a.load(fa);
+    b.load(fb);
+    MapDiff d = diffMaps(a, b);
+
+    if (d.sizeChanged())
+        out << "size: " << d.sizeA.width() << "x" << d.sizeA.height() << " -> " << d.sizeB.width() << "x" << d.sizeB.height() << "\n";
+
+    // tiles which have different ids in both files
+    QVector<int> idInB(d.table.size(), -1);
+    for(int i = 0; i < d.remapB.size(); ++i)
+        idInB[d.remapB[i]] = i;
+    for(int i = 0; i < d.remapA.size(); ++i) {
+        int other = idInB[d.remapA[i]];
+        if (other != i)
+            out << "tile " << d.table.key(d.remapA[i]) << ": " << i << " -> " << (other < 0 ? QString("removed") : QString::number(other)) << "\n";
+    }
+    QVector<bool> inA(d.table.size(), false);
+    for(int i = 0; i < d.remapA.size(); ++i)
+        inA[d.remapA[i]] = true;
+    for(int i = 0; i < d.remapB.size(); ++i) {
+        if (!inA[d.remapB[i]])
+            out << "tile " << d.table.key(d.remapB[i]) << ": added -> " << i << "\n";
+    }
+
+    out << "chunks: " << d.changedChunks << " of " << d.chunks << " changed\n";
+    for(int r = 0; r < d.regions.size(); ++r) {
+        QRect const & reg = d.regions[r];
+        out << "region " << reg.x() << "," << reg.y() << " " << reg.width() << "x" << reg.height() << "\n";
+    }
+    for(int i = 0; i < d.cells.size(); ++i) {
+        CellChange const & c = d.cells[i];
+        out << "  cell " << c.x << "," << c.y << ": " << tileName(d.table, c.before) << " -> " << tileName(d.table, c.after) << "\n";
+    }
+    return d.isEmpty() ? 0 : 1;
+}
+
+static int runMerge(QString const & fbase, QString const & fours, QString const & ftheirs, QString const & fout, QTextStream & out)
+{
+    MapFile base, ours, theirs, result;
+    base.load(fbase);
+    ours.load(fours);
+    theirs.load(ftheirs);
+
+    QVector<MergeConflict> conflicts = mergeMaps(base, ours, theirs, result);
+    QString error;
+    if (!result.save(fout, &error)) {
+        out << "Failed to write " << fout << ": " << error << "\n";
+        return 2;
+    }
+
+    for(int i = 0; i < conflicts.size(); ++i) {
+        if (!conflicts[i].key.isEmpty()) {
+            out << "CONFLICT " << conflicts[i].key << ": changed on both sides, kept ours\n";
+            continue;
+        }
+        QRect const & reg = conflicts[i].region;
+        out << "CONFLICT region " << reg.x() << "," << reg.y() << " " << reg.width() << "x" << reg.height()
+            << ": " << conflicts[i].cells << " cells, kept ours\n";
+    }
+    return conflicts.isEmpty() ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    QStringList args = app.arguments();
+
+    try {
+        if (args.size() == 4 && args[1] == "diff")
+            return runDiff(args[2], args[3], out);
+        if ((args.size() == 5 || args.size() == 6) && args[1] == "merge")
+            return runMerge(args[2], args[3], args[4], args.size() == 6 ? args[5] : args[3], out);
+    } catch (QString & s) {
+        out << "Error: " << s << "\n";
+        return 2;
+    }
+
+    out << "Usage:\n"
+        << "    mapmerge diff <a> <b>\n"
+        << "    mapmerge merge <base> <ours> <theirs> [<output>]\n";
+    return 2;
+}
@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Headless diff and three-way merge of MapEd maps
+#
+#-------------------------------------------------
+
+QT       += core concurrent
+QT       -= gui
+
+TARGET = mapmerge
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += ../..
+
+SOURCES += main.cpp \
+    ../../mapfile.cpp \
+    ../../mapdiff.cpp \
+    ../../mapsave.cpp
+
+HEADERS  += \
+    ../../mapfile.h \
+    ../../mapdiff.h \
+    ../../mapsave.h
@@ -0,0 +1,156 @@
+/*
+ * \file mergetest.cpp
+ * \author Igor Bereznyak <igor.bereznyak@gmail.com>
+ * \brief Checks of mergeMaps() on maps built in memory.
+ *
+ * Usage: mergetest
+ *
+ * Exit code is 0 if all checks pass, 1 otherwise.
+ **/
+#include "mapdiff.h"
+
+#include <QCoreApplication>
+#include <QTextStream>
+
+static int failures = 0;
+
+static void check(bool ok, QString const & what, QTextStream & out)
+{
+    out << (ok ? "ok   " : "FAIL ") << what << "\n";
+    if (!ok) ++failures;
+}
+
+static QString objectTile(MapFile const & map, int item)
+{
+    QJsonArray jsn_items = map.extra.value("objects").toObject().value("items").toArray();
+    return map.tileKey(int(jsn_items.at(item).toObject().value("tile").toDouble(-1)));
+}
+
+/*!
+ * \brief Ours lists the same tile twice, so the merged tile table is shorter and ids
+ * after the duplicate shift; objects and animations must follow their tiles.
+ */
+static void testDuplicateTileKeepsObjects(QTextStream & out)
+{
+    MapFile base;
+    base.rows = 2;
+    base.cols = 2;
+    base.tiles << QJsonValue(QString("grass.png")) << QJsonValue(QString("grass.png"))
+               << QJsonValue(QString("tree.png")) << QJsonValue(QString("water0.png")) << QJsonValue(QString("water1.png"));
+    base.cells << 0 << 1 << 3 << 0;
+
+    QJsonObject jsn_item;
+    jsn_item.insert("tile", QJsonValue(2));
+    jsn_item.insert("x", QJsonValue(8));
+    jsn_item.insert("y", QJsonValue(8));
+    QJsonArray jsn_items;
+    jsn_items.push_back(jsn_item);
+    QJsonObject jsn_objects;
+    jsn_objects.insert("bucketSize", QJsonValue(256));
+    jsn_objects.insert("items", jsn_items);
+    base.extra.insert("objects", jsn_objects);
+
+    QJsonArray jsn_frames;
+    for(int f = 3; f <= 4; ++f) {
+        QJsonObject jsn_frame;
+        jsn_frame.insert("tile", QJsonValue(f));
+        jsn_frame.insert("duration", QJsonValue(100));
+        jsn_frames.push_back(jsn_frame);
+    }
+    QJsonObject jsn_animations;
+    jsn_animations.insert("3", jsn_frames);
+    base.extra.insert("animations", jsn_animations);
+
+    MapFile ours = base;
+    MapFile theirs = base;
+    theirs.cells[3] = 2;
+
+    MapFile result;
+    QVector<MergeConflict> conflicts = mergeMaps(base, ours, theirs, result);
+    check(conflicts.isEmpty(), "merge is clean", out);
+    check(result.tiles.size() == 4, "duplicate tile is merged", out);
+    check(result.tileKey(result.cells[3]) == "tree.png", "cell of theirs is taken", out);
+    check(objectTile(result, 0) == "tree.png", "object keeps its tile", out);
+
+    QJsonObject jsn_result = result.extra.value("animations").toObject();
+    check(jsn_result.size() == 1, "animation is kept", out);
+    if (jsn_result.size() == 1) {
+        check(result.tileKey(jsn_result.begin().key().toInt()) == "water0.png", "animation keeps its tile", out);
+        QJsonArray jsn_result_frames = jsn_result.begin().value().toArray();
+        check(result.tileKey(int(jsn_result_frames.at(1).toObject().value("tile").toDouble(-1))) == "water1.png", "animation frame keeps its tile", out);
+    }
+}
+
+static void addObject(MapFile & map, int tile, int x, int y)
+{
+    QJsonObject jsn_objects = map.extra.value("objects").toObject();
+    QJsonArray jsn_items = jsn_objects.value("items").toArray();
+    QJsonObject jsn_item;
+    jsn_item.insert("tile", QJsonValue(tile));
+    jsn_item.insert("x", QJsonValue(x));
+    jsn_item.insert("y", QJsonValue(y));
+    jsn_items.push_back(jsn_item);
+    jsn_objects.insert("bucketSize", QJsonValue(256));
+    jsn_objects.insert("items", jsn_items);
+    map.extra.insert("objects", jsn_objects);
+}
+
+static MapFile smallMap()
+{
+    MapFile map;
+    map.rows = 2;
+    map.cols = 2;
+    map.tiles << QJsonValue(QString("grass.png")) << QJsonValue(QString("tree.png")) << QJsonValue(QString("rock.png"));
+    map.cells << 0 << 0 << 0 << 0;
+    addObject(map, 1, 0, 0);
+    return map;
+}
+
+/*!
+ * \brief An object added only by theirs must be in the result, while cells of ours are kept.
+ */
+static void testTheirObjectIsTaken(QTextStream & out)
+{
+    MapFile base = smallMap();
+    MapFile ours = base;
+    ours.cells[0] = 2;
+    MapFile theirs = base;
+    addObject(theirs, 2, 16, 16);
+
+    MapFile result;
+    QVector<MergeConflict> conflicts = mergeMaps(base, ours, theirs, result);
+    check(conflicts.isEmpty(), "merge with their object is clean", out);
+    check(result.extra.value("objects").toObject().value("items").toArray().size() == 2, "their object is taken", out);
+    check(objectTile(result, 1) == "rock.png", "their object keeps its tile", out);
+    check(result.tileKey(result.cells[0]) == "rock.png", "our cell is kept", out);
+}
+
+/*!
+ * \brief Objects added on both sides are a conflict, not a silent loss of theirs.
+ */
+static void testObjectsOnBothSidesConflict(QTextStream & out)
+{
+    MapFile base = smallMap();
+    MapFile ours = base;
+    addObject(ours, 1, 32, 0);
+    MapFile theirs = base;
+    addObject(theirs, 2, 16, 16);
+
+    MapFile result;
+    QVector<MergeConflict> conflicts = mergeMaps(base, ours, theirs, result);
+    check(conflicts.size() == 1 && conflicts[0].key == "objects", "objects changed on both sides conflict", out);
+    check(result.extra.value("objects").toObject().value("items").toArray().size() == 2, "conflicting objects keep ours", out);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+
+    testDuplicateTileKeepsObjects(out);
+    testTheirObjectIsTaken(out);
+    testObjectsOnBothSidesConflict(out);
+
+    out << (failures ? QString("%1 checks failed\n").arg(failures) : QString("all checks passed\n"));
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Checks of the three-way map merge
+#
+#-------------------------------------------------
+
+QT       += core concurrent
+QT       -= gui
+
+TARGET = mergetest
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += ../../..
+
+SOURCES += mergetest.cpp \
+    ../../../mapfile.cpp \
+    ../../../mapdiff.cpp \
+    ../../../mapsave.cpp
+
+HEADERS  += \
+    ../../../mapfile.h \
+    ../../../mapdiff.h \
+    ../../../mapsave.h